@@ -0,0 +1,25 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+const auto MinMeasuredTime = std::chrono::milliseconds(200);
+const std::size_t MinMeasuredIterations = 3;
+
+// Average time of a single call of fn in microseconds, fn is called repeatedly (with the iteration number) for at least MinMeasuredTime
+template <typename Fn>
+double measure(Fn&& fn)
+{
+	using Clock = std::chrono::steady_clock;
+
+	std::size_t iterations = 0;
+	auto start = Clock::now();
+	auto elapsed = Clock::duration::zero();
+	while (iterations < MinMeasuredIterations || elapsed < MinMeasuredTime)
+	{
+		fn(iterations++);
+		elapsed = Clock::now() - start;
+	}
+
+	return std::chrono::duration<double, std::micro>(elapsed).count() / iterations;
+}
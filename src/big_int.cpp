@@ -1,11 +1,114 @@
 #include <iostream>
 
+#include <algorithm>
+#include <cstring>
+
 #include <gmp.h>
 
-#include <openssl/bn.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "big_int.h"
+#include "big_int_backend.h"
 #include "message.h"
+#include "mod_context.h"
+#include "random_pool.h"
+
+namespace {
+
+// Global BigInts may be calculated before the globals of this file are initialized, so the backend is a function-local static
+const BigIntBackend*& currentBackend()
+{
+	static const BigIntBackend* backend = getBigIntBackends().front();
+	return backend;
+}
+
+// Limbs can be copied as bytes only if they are stored little-endian without nail bits, otherwise mpz_import/mpz_export is used
+constexpr bool PlainLimbs = __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && GMP_NAIL_BITS == 0;
+
+void reverseCopyScalar(std::uint8_t* dst, const std::uint8_t* src, std::size_t count)
+{
+	for (std::size_t i = 0; i < count; ++i)
+		dst[i] = src[count - 1 - i];
+}
+
+// AVX2 is only available on x86, everything else reverses the bytes one by one
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) void reverseCopyAvx2(std::uint8_t* dst, const std::uint8_t* src, std::size_t count)
+{
+	// Shuffle reverses bytes only within each 128-bit lane, permute then swaps the lanes
+	const auto reverseMask = _mm256_setr_epi8(
+		15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+		15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0
+	);
+
+	std::size_t done = 0;
+	for (; done + 32 <= count; done += 32)
+	{
+		auto block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + count - done - 32));
+		block = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(block, reverseMask), 0x4E);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + done), block);
+	}
+
+	reverseCopyScalar(dst + done, src, count - done);
+}
+#endif
+
+// Copies count bytes from src to dst in reversed order, which converts between big-endian bytes and little-endian limbs
+void reverseCopy(std::uint8_t* dst, const std::uint8_t* src, std::size_t count)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+	if (hasAvx2 && count >= 32)
+	{
+		reverseCopyAvx2(dst, src, count);
+		return;
+	}
+#endif
+
+	reverseCopyScalar(dst, src, count);
+}
+
+std::size_t getByteCount(mpz_srcptr number)
+{
+	return mpz_sgn(number) == 0 ? 0 : mpz_sizeinbase(number, 256);
+}
+
+void exportBytes(mpz_srcptr number, std::uint8_t* bytes, std::size_t byteCount)
+{
+	if (byteCount == 0)
+		return;
+
+	if (PlainLimbs)
+		reverseCopy(bytes, reinterpret_cast<const std::uint8_t*>(mpz_limbs_read(number)), byteCount);
+	else
+		mpz_export(bytes, nullptr, 1, 1, 0, 0, number);
+}
+
+void importBytes(mpz_ptr number, const std::uint8_t* bytes, std::size_t byteCount)
+{
+	if (!PlainLimbs)
+	{
+		mpz_import(number, byteCount, 1, 1, 0, 0, bytes);
+		return;
+	}
+
+	auto limbCount = static_cast<mp_size_t>((byteCount + sizeof(mp_limb_t) - 1) / sizeof(mp_limb_t));
+	if (limbCount == 0)
+	{
+		mpz_set_ui(number, 0);
+		return;
+	}
+
+	// Top limb may be filled only partially, mpz_limbs_finish() then strips the leading zero limbs
+	auto limbs = mpz_limbs_write(number, limbCount);
+	limbs[limbCount - 1] = 0;
+	reverseCopy(reinterpret_cast<std::uint8_t*>(limbs), bytes, byteCount);
+	mpz_limbs_finish(number, limbCount);
+}
+
+} // namespace
 
 BigInt::BigInt() : _impl()
 {
@@ -19,21 +122,60 @@ BigInt::BigInt(const std::string& number) : _impl(number.c_str())
 {
 }
 
-BigInt::BigInt(const std::vector<std::uint8_t>& bytes) : _impl()
+BigInt::BigInt(const std::vector<std::uint8_t>& bytes) : BigInt(bytes.data(), bytes.size())
+{
+}
+
+BigInt::BigInt(const std::uint8_t* bytes, std::size_t size) : _impl()
 {
-	mpz_import(_impl.get_mpz_t(), bytes.size(), 1, 1, 0, 0, bytes.data());
+	importBytes(_impl.get_mpz_t(), bytes, size);
 }
 
 BigInt BigInt::random(std::size_t numberOfBits)
 {
-	auto number = BN_new();
+	BigInt result;
+	if (numberOfBits == 0)
+		return result;
+
+	// Limbs are filled with random bytes directly, their byte order does not matter
+	auto number = result._impl.get_mpz_t();
+	auto limbCount = static_cast<mp_size_t>((numberOfBits + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS);
+	auto limbs = mpz_limbs_write(number, limbCount);
+	RandomPool::getThreadInstance().generate(reinterpret_cast<std::uint8_t*>(limbs), limbCount * sizeof(mp_limb_t));
+
+	// Same as BN_rand() with BN_RAND_TOP_TWO, the number has exactly numberOfBits bits and its two highest bits are set
+	auto topBits = (numberOfBits - 1) % GMP_NUMB_BITS + 1;
+	auto& topLimb = limbs[limbCount - 1];
+	if (topBits < GMP_NUMB_BITS)
+		topLimb &= (mp_limb_t{1} << topBits) - 1;
+	topLimb |= mp_limb_t{1} << (topBits - 1);
+	if (topBits >= 2)
+		topLimb |= mp_limb_t{1} << (topBits - 2);
+	else if (limbCount >= 2)
+		limbs[limbCount - 2] |= mp_limb_t{1} << (GMP_NUMB_BITS - 1);
+
+	mpz_limbs_finish(number, limbCount);
+	return result;
+}
 
-	BN_rand(number, numberOfBits, 1, 0);
-	std::vector<std::uint8_t> bytes(BN_num_bytes(number));
-	BN_bn2bin(number, bytes.data());
+void BigInt::setBackend(const BigIntBackend& backend)
+{
+	currentBackend() = &backend;
+}
 
-	BN_clear_free(number);
-	return bytes;
+const BigIntBackend& BigInt::getBackend()
+{
+	return *currentBackend();
+}
+
+void BigInt::mulMod(const BigInt& lhs, const BigInt& rhs, const BigInt& mod, BigInt& result)
+{
+	// Result may be one of the operands, backends handle the overlap and reuse the limbs result already has
+	auto backend = currentBackend();
+	backend->multiply(result._impl.get_mpz_t(), lhs._impl.get_mpz_t(), rhs._impl.get_mpz_t());
+	backend->remainder(result._impl.get_mpz_t(), result._impl.get_mpz_t(), mod._impl.get_mpz_t());
+	if (mpz_sgn(result._impl.get_mpz_t()) < 0)
+		mpz_add(result._impl.get_mpz_t(), result._impl.get_mpz_t(), mod._impl.get_mpz_t());
 }
 
 std::size_t BigInt::getNumberOfBits() const
@@ -43,15 +185,18 @@ std::size_t BigInt::getNumberOfBits() const
 
 std::vector<std::uint8_t> BigInt::getRawBytes() const
 {
-	size_t size = getNumberOfBits() / 8 + 1;
-
-	std::vector<std::uint8_t> bytes(size);
-	mpz_export(bytes.data(), &size, 1, 1, 0, 0, _impl.get_mpz_t());
-	bytes.resize(size);
-
+	std::vector<std::uint8_t> bytes(getByteCount(_impl.get_mpz_t()));
+	exportBytes(_impl.get_mpz_t(), bytes.data(), bytes.size());
 	return bytes;
 }
 
+void BigInt::writeRawBytes(std::uint8_t* output, std::size_t size) const
+{
+	auto byteCount = std::min(getByteCount(_impl.get_mpz_t()), size);
+	std::fill(output, output + size - byteCount, 0);
+	exportBytes(_impl.get_mpz_t(), output + size - byteCount, byteCount);
+}
+
 std::int8_t BigInt::getSign() const
 {
 	return sgn(_impl);
@@ -67,14 +212,21 @@ BigInt BigInt::raise(std::uint64_t power) const
 BigInt BigInt::raiseMod(const BigInt& power, const BigInt& mod) const
 {
 	BigInt result;
-	mpz_powm(result._impl.get_mpz_t(), _impl.get_mpz_t(), power._impl.get_mpz_t(), mod._impl.get_mpz_t());
+	raiseMod(power, mod, result);
 	return result;
 }
 
+void BigInt::raiseMod(const BigInt& power, const BigInt& mod, BigInt& result) const
+{
+	currentBackend()->raiseMod(result._impl.get_mpz_t(), _impl.get_mpz_t(), power._impl.get_mpz_t(), mod._impl.get_mpz_t());
+}
+
 BigInt BigInt::invertMod(const BigInt& mod) const
 {
 	BigInt result;
-	mpz_invert(result._impl.get_mpz_t(), _impl.get_mpz_t(), mod._impl.get_mpz_t());
+	if (!currentBackend()->invertMod(result._impl.get_mpz_t(), _impl.get_mpz_t(), mod._impl.get_mpz_t()))
+		throw NotInvertibleError();
+
 	return result;
 }
 
@@ -83,16 +235,23 @@ void BigInt::setSign(std::int8_t sign)
 	if (getSign() == sign)
 		return;
 
-	_impl = -_impl;
+	mpz_neg(_impl.get_mpz_t(), _impl.get_mpz_t());
 }
 
-BigInt BigInt::operator-() const
+BigInt BigInt::operator-() const&
 {
-	BigInt result = *this;
-	result.setSign(!result.getSign());
+	BigInt result;
+	mpz_neg(result._impl.get_mpz_t(), _impl.get_mpz_t());
 	return result;
 }
 
+BigInt BigInt::operator-() &&
+{
+	// Temporary can be negated in place, its limbs are then moved to the result
+	mpz_neg(_impl.get_mpz_t(), _impl.get_mpz_t());
+	return std::move(*this);
+}
+
 BigInt BigInt::operator-(const BigInt& rhs) const
 {
 	BigInt result;
@@ -103,17 +262,35 @@ BigInt BigInt::operator-(const BigInt& rhs) const
 BigInt BigInt::operator*(const BigInt& rhs) const
 {
 	BigInt result;
-	result._impl = _impl * rhs._impl;
+	currentBackend()->multiply(result._impl.get_mpz_t(), _impl.get_mpz_t(), rhs._impl.get_mpz_t());
 	return result;
 }
 
 BigInt BigInt::operator%(const BigInt& rhs) const
 {
 	BigInt result;
-	result._impl = _impl % rhs._impl;
+	currentBackend()->remainder(result._impl.get_mpz_t(), _impl.get_mpz_t(), rhs._impl.get_mpz_t());
 	return result;
 }
 
+BigInt& BigInt::operator+=(const BigInt& rhs)
+{
+	mpz_add(_impl.get_mpz_t(), _impl.get_mpz_t(), rhs._impl.get_mpz_t());
+	return *this;
+}
+
+BigInt& BigInt::operator*=(const BigInt& rhs)
+{
+	currentBackend()->multiply(_impl.get_mpz_t(), _impl.get_mpz_t(), rhs._impl.get_mpz_t());
+	return *this;
+}
+
+BigInt& BigInt::operator%=(const BigInt& rhs)
+{
+	currentBackend()->remainder(_impl.get_mpz_t(), _impl.get_mpz_t(), rhs._impl.get_mpz_t());
+	return *this;
+}
+
 bool BigInt::operator<(const BigInt& rhs) const
 {
 	return _impl < rhs._impl;
@@ -146,10 +323,20 @@ bool BigInt::operator!=(const BigInt& rhs) const
 
 const Message& operator>>(const Message& msg, BigInt& bigint)
 {
-	auto sign = msg.read<std::int8_t>();
-	auto bytes = msg.readSequence<std::uint8_t>();
-	bigint = bytes;
-	bigint.setSign(sign);
+	if (msg.getWireFormat() == WireFormatV1)
+	{
+		auto sign = msg.read<std::int8_t>();
+		auto bytes = msg.readByteSequence();
+		importBytes(bigint._impl.get_mpz_t(), bytes.getData(), bytes.getSize());
+		bigint.setSign(sign);
+		return msg;
+	}
+
+	// Lowest bit of the size carries the sign
+	auto header = msg.readSequenceHeader();
+	auto bytes = msg.readBytes(header >> 1);
+	importBytes(bigint._impl.get_mpz_t(), bytes.getData(), bytes.getSize());
+	bigint.setSign((header & 1) != 0 ? -1 : 1);
 	return msg;
 }
 
@@ -161,9 +348,19 @@ std::ostream& operator<<(std::ostream& out, const BigInt& bigint)
 
 Message& operator<<(Message& msg, const BigInt& bigint)
 {
-	auto bytes = bigint.getRawBytes();
-	msg.write<std::int8_t>(bigint.getSign());
-	msg.writeSequence<std::uint8_t>(bytes.begin(), bytes.end());
+	// Magnitude is copied straight from the limbs into the message storage without any temporary buffer
+	auto number = bigint._impl.get_mpz_t();
+	auto byteCount = getByteCount(number);
+	if (msg.getWireFormat() == WireFormatV1)
+	{
+		msg.write<std::int8_t>(bigint.getSign());
+		exportBytes(number, msg.writeByteSequence(byteCount), byteCount);
+		return msg;
+	}
+
+	msg.reserve(Message::getSequenceHeaderSize(byteCount << 1) + byteCount);
+	msg.writeSequenceHeader((byteCount << 1) | (bigint.getSign() < 0 ? 1 : 0));
+	exportBytes(number, msg.appendBytes(byteCount), byteCount);
 	return msg;
 }
 
@@ -5,6 +5,7 @@
 
 #include <gmpxx.h>
 
+class BigIntBackend;
 class Message;
 
 class BigInt
@@ -14,14 +15,24 @@ public:
 	BigInt(std::uint64_t number);
 	BigInt(const std::string& number);
 	BigInt(const std::vector<std::uint8_t>& bytes);
+	BigInt(const std::uint8_t* bytes, std::size_t size);
 	BigInt(const BigInt&) = default;
+	BigInt(BigInt&&) noexcept = default;
 
 	BigInt& operator=(const BigInt&) = default;
+	BigInt& operator=(BigInt&&) noexcept = default;
 
 	static BigInt random(std::size_t numberOfBits);
 
+	// Backend of raiseMod(), invertMod(), multiplication and remainder, it is supposed to be set only once at startup
+	static void setBackend(const BigIntBackend& backend);
+	static const BigIntBackend& getBackend();
+	// Result is in [0, mod) and may be one of the operands, both steps go through the backend
+	static void mulMod(const BigInt& lhs, const BigInt& rhs, const BigInt& mod, BigInt& result);
+
 	std::size_t getNumberOfBits() const;
 	std::vector<std::uint8_t> getRawBytes() const;
+	void writeRawBytes(std::uint8_t* output, std::size_t size) const; // big-endian magnitude padded with zeroes to size bytes
 	std::int8_t getSign() const;
 
 	template <typename T>
@@ -38,15 +49,21 @@ public:
 
 	BigInt raise(std::uint64_t power) const;
 	BigInt raiseMod(const BigInt& power, const BigInt& mod) const;
-	BigInt invertMod(const BigInt& mod) const;
+	void raiseMod(const BigInt& power, const BigInt& mod, BigInt& result) const;
+	BigInt invertMod(const BigInt& mod) const; // throws NotInvertibleError if there is no inverse
 
 	void setSign(std::int8_t sign);
 
-	BigInt operator-() const;
+	BigInt operator-() const&;
+	BigInt operator-() &&;
 	BigInt operator-(const BigInt& rhs) const;
 	BigInt operator*(const BigInt& rhs) const;
 	BigInt operator%(const BigInt& rhs) const;
 
+	BigInt& operator+=(const BigInt& rhs);
+	BigInt& operator*=(const BigInt& rhs);
+	BigInt& operator%=(const BigInt& rhs);
+
 	bool operator<(const BigInt& rhs) const;
 	bool operator>(const BigInt& rhs) const;
 	bool operator<=(const BigInt& rhs) const;
@@ -59,6 +76,9 @@ public:
 	friend const Message& operator>>(const Message& msg, BigInt& bigint);
 	friend Message& operator<<(Message& msg, const BigInt& bigint);
 
+	friend class DhGroup;
+	friend class ModContext;
+
 private:
 	mpz_class _impl;
 };
@@ -0,0 +1,221 @@
+#include <algorithm>
+#include <cctype>
+#include <memory>
+
+#include <gmpxx.h>
+
+#include <openssl/bn.h>
+
+#include "big_int_backend.h"
+
+namespace {
+
+// Limbs can be passed to OpenSSL as little-endian bytes only if they are stored that way without nail bits
+constexpr bool PlainLimbs = __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && GMP_NAIL_BITS == 0;
+
+using BnHandle = std::unique_ptr<BIGNUM, decltype(&BN_clear_free)>;
+
+BnHandle makeBn()
+{
+	return { BN_new(), &BN_clear_free };
+}
+
+void toBn(mpz_srcptr from, BIGNUM* to)
+{
+	if (PlainLimbs)
+		BN_lebin2bn(reinterpret_cast<const unsigned char*>(mpz_limbs_read(from)), mpz_size(from) * sizeof(mp_limb_t), to);
+	else
+	{
+		std::vector<unsigned char> bytes((mpz_sizeinbase(from, 2) + 7) / 8);
+		std::size_t size = 0;
+		mpz_export(bytes.data(), &size, 1, 1, 0, 0, from);
+		BN_bin2bn(bytes.data(), size, to);
+	}
+
+	BN_set_negative(to, mpz_sgn(from) < 0);
+}
+
+void fromBn(const BIGNUM* from, mpz_ptr to)
+{
+	auto byteCount = static_cast<std::size_t>(BN_num_bytes(from));
+	if (PlainLimbs)
+	{
+		auto limbCount = static_cast<mp_size_t>((byteCount + sizeof(mp_limb_t) - 1) / sizeof(mp_limb_t));
+		if (limbCount == 0)
+			mpz_set_ui(to, 0);
+		else
+		{
+			auto limbs = mpz_limbs_write(to, limbCount);
+			BN_bn2lebinpad(from, reinterpret_cast<unsigned char*>(limbs), limbCount * sizeof(mp_limb_t));
+			mpz_limbs_finish(to, limbCount);
+		}
+	}
+	else
+	{
+		std::vector<unsigned char> bytes(byteCount);
+		BN_bn2bin(from, bytes.data());
+		mpz_import(to, byteCount, 1, 1, 0, 0, bytes.data());
+	}
+
+	if (BN_is_negative(from))
+		mpz_neg(to, to);
+}
+
+class GmpBackend : public BigIntBackend
+{
+public:
+	virtual const char* getName() const override { return "GMP"; }
+
+	virtual void raiseMod(mpz_ptr result, mpz_srcptr base, mpz_srcptr power, mpz_srcptr mod) const override
+	{
+		mpz_powm(result, base, power, mod);
+	}
+
+	virtual bool invertMod(mpz_ptr result, mpz_srcptr value, mpz_srcptr mod) const override
+	{
+		return mpz_invert(result, value, mod) != 0;
+	}
+
+	virtual void multiply(mpz_ptr result, mpz_srcptr lhs, mpz_srcptr rhs) const override
+	{
+		mpz_mul(result, lhs, rhs);
+	}
+
+	virtual void remainder(mpz_ptr result, mpz_srcptr lhs, mpz_srcptr rhs) const override
+	{
+		mpz_tdiv_r(result, lhs, rhs);
+	}
+};
+
+class GmpSecBackend : public GmpBackend
+{
+public:
+	virtual const char* getName() const override { return "GMP-sec"; }
+
+	virtual void raiseMod(mpz_ptr result, mpz_srcptr base, mpz_srcptr power, mpz_srcptr mod) const override
+	{
+		// Time and memory access pattern do not depend on the exponent, which requires odd modulus and positive exponent
+		if (mpz_odd_p(mod) && mpz_sgn(power) > 0)
+			mpz_powm_sec(result, base, power, mod);
+		else
+			mpz_powm(result, base, power, mod);
+	}
+};
+
+class OpenSslBackend : public BigIntBackend
+{
+public:
+	virtual const char* getName() const override { return "OpenSSL"; }
+
+	virtual void raiseMod(mpz_ptr result, mpz_srcptr base, mpz_srcptr power, mpz_srcptr mod) const override
+	{
+		// OpenSSL does not support negative exponents and Montgomery multiplication needs odd modulus
+		if (mpz_sgn(power) < 0 || !mpz_odd_p(mod))
+		{
+			mpz_powm(result, base, power, mod);
+			return;
+		}
+
+		auto& state = getThreadState();
+		auto montgomery = getMontgomeryContext(state, mod);
+		toBn(base, state.lhs.get());
+		toBn(power, state.exponent.get());
+
+		BN_mod_exp_mont(state.result.get(), state.lhs.get(), state.exponent.get(), state.modulus.get(), state.ctx.get(), montgomery);
+		fromBn(state.result.get(), result);
+	}
+
+	virtual bool invertMod(mpz_ptr result, mpz_srcptr value, mpz_srcptr mod) const override
+	{
+		auto& state = getThreadState();
+		toBn(value, state.lhs.get());
+		toBn(mod, state.rhs.get());
+		if (BN_mod_inverse(state.result.get(), state.lhs.get(), state.rhs.get(), state.ctx.get()) == nullptr)
+			return false;
+
+		fromBn(state.result.get(), result);
+		return true;
+	}
+
+	virtual void multiply(mpz_ptr result, mpz_srcptr lhs, mpz_srcptr rhs) const override
+	{
+		auto& state = getThreadState();
+		toBn(lhs, state.lhs.get());
+		toBn(rhs, state.rhs.get());
+		BN_mul(state.result.get(), state.lhs.get(), state.rhs.get(), state.ctx.get());
+		fromBn(state.result.get(), result);
+	}
+
+	virtual void remainder(mpz_ptr result, mpz_srcptr lhs, mpz_srcptr rhs) const override
+	{
+		auto& state = getThreadState();
+		toBn(lhs, state.lhs.get());
+		toBn(rhs, state.rhs.get());
+		BN_mod(state.result.get(), state.lhs.get(), state.rhs.get(), state.ctx.get());
+		fromBn(state.result.get(), result);
+	}
+
+private:
+	// Temporaries and Montgomery context of the last modulus are kept per thread, so they are not allocated by every operation
+	struct ThreadState
+	{
+		ThreadState() : ctx(BN_CTX_new(), &BN_CTX_free), lhs(makeBn()), rhs(makeBn()), result(makeBn()), exponent(makeBn()), modulus(makeBn()),
+			montgomery(nullptr, &BN_MONT_CTX_free), montgomeryModulus()
+		{
+			// Exponentiation takes the constant time path, same as OpenSSL uses for its own Diffie-Hellman
+			BN_set_flags(exponent.get(), BN_FLG_CONSTTIME);
+		}
+
+		std::unique_ptr<BN_CTX, decltype(&BN_CTX_free)> ctx;
+		BnHandle lhs;
+		BnHandle rhs;
+		BnHandle result;
+		BnHandle exponent;
+		BnHandle modulus; // modulus of the Montgomery context
+		std::unique_ptr<BN_MONT_CTX, decltype(&BN_MONT_CTX_free)> montgomery;
+		mpz_class montgomeryModulus;
+	};
+
+	static ThreadState& getThreadState()
+	{
+		thread_local ThreadState state;
+		return state;
+	}
+
+	static BN_MONT_CTX* getMontgomeryContext(ThreadState& state, mpz_srcptr mod)
+	{
+		if (state.montgomery == nullptr || mpz_cmp(state.montgomeryModulus.get_mpz_t(), mod) != 0)
+		{
+			toBn(mod, state.modulus.get());
+			state.montgomery.reset(BN_MONT_CTX_new());
+			BN_MONT_CTX_set(state.montgomery.get(), state.modulus.get(), state.ctx.get());
+			mpz_set(state.montgomeryModulus.get_mpz_t(), mod);
+		}
+
+		return state.montgomery.get();
+	}
+};
+
+}
+
+const std::vector<const BigIntBackend*>& getBigIntBackends()
+{
+	static const GmpBackend gmp;
+	static const GmpSecBackend gmpSec;
+	static const OpenSslBackend openSsl;
+	static const std::vector<const BigIntBackend*> backends = { &gmp, &gmpSec, &openSsl };
+	return backends;
+}
+
+const BigIntBackend& getBigIntBackend(const std::string& name)
+{
+	for (auto backend : getBigIntBackends())
+	{
+		std::string backendName = backend->getName();
+		if (std::equal(name.begin(), name.end(), backendName.begin(), backendName.end(),
+					[](char lhs, char rhs) { return std::tolower(lhs) == std::tolower(rhs); }))
+			return *backend;
+	}
+
+	throw UnknownBigIntBackendError(name);
+}
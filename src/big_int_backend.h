@@ -0,0 +1,40 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <gmp.h>
+
+#include "error.h"
+
+class UnknownBigIntBackendError : public Error
+{
+public:
+	UnknownBigIntBackendError(const std::string& name) noexcept : Error("Unknown big integer backend '" + name + "'.") {}
+};
+
+/**
+ * Implementation of the expensive part of BigInt arithmetic, which is modular exponentiation and inversion,
+ * multiplication and remainder after division. Operands are always GMP integers, backends with different
+ * representation convert them on the way in and out. Result may be one of the operands.
+ *
+ * Backend used by BigInt is chosen at startup with BigInt::setBackend(), see also benchmarkBigIntBackends().
+ */
+class BigIntBackend
+{
+public:
+	virtual ~BigIntBackend() = default;
+
+	virtual const char* getName() const = 0;
+
+	virtual void raiseMod(mpz_ptr result, mpz_srcptr base, mpz_srcptr power, mpz_srcptr mod) const = 0;
+	virtual bool invertMod(mpz_ptr result, mpz_srcptr value, mpz_srcptr mod) const = 0;
+	virtual void multiply(mpz_ptr result, mpz_srcptr lhs, mpz_srcptr rhs) const = 0;
+	virtual void remainder(mpz_ptr result, mpz_srcptr lhs, mpz_srcptr rhs) const = 0; // sign of lhs, same as C++ operator%
+};
+
+// GMP, GMP with side-channel silent exponentiation and OpenSSL Montgomery (constant time) backends, in this order
+const std::vector<const BigIntBackend*>& getBigIntBackends();
+
+// Finds the backend by its name (case does not matter)
+const BigIntBackend& getBigIntBackend(const std::string& name);
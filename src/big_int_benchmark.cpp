@@ -0,0 +1,81 @@
+#include <iomanip>
+
+#include "benchmark.h"
+#include "big_int_benchmark.h"
+
+namespace {
+
+const std::size_t InputCount = 16;
+
+}
+
+const BigIntBackend& benchmarkBigIntBackends(const std::vector<BigIntBenchmarkCase>& cases, std::ostream& out)
+{
+	const auto& backends = getBigIntBackends();
+	const auto& originalBackend = BigInt::getBackend();
+
+	std::vector<double> totalRaiseTimes(backends.size(), 0.0);
+	std::vector<bool> allMatch(backends.size(), true);
+	for (const auto& benchCase : cases)
+	{
+		const auto& modulus = benchCase.modulus;
+		std::vector<BigInt> bases, exponents;
+		for (std::size_t i = 0; i < InputCount; ++i)
+		{
+			bases.push_back(BigInt::random(modulus.getNumberOfBits() - 1));
+			exponents.push_back(BigInt::random(benchCase.exponentBits));
+		}
+
+		out << "=== " << benchCase.name << " (" << modulus.getNumberOfBits() << "-bit modulus, " << benchCase.exponentBits << "-bit exponent)\n";
+		out << std::left << std::setw(10) << "backend" << std::right << std::setw(14) << "raiseMod [us]" << std::setw(15) << "invertMod [us]"
+			<< std::setw(12) << "mulMod [us]" << '\n';
+
+		std::vector<BigInt> expected;
+		std::size_t fastest = 0;
+		std::vector<double> raiseTimes;
+		for (std::size_t backendIndex = 0; backendIndex < backends.size(); ++backendIndex)
+		{
+			BigInt::setBackend(*backends[backendIndex]);
+
+			// Every backend has to come up with the same results as the first one
+			bool matches = true;
+			for (std::size_t i = 0; i < InputCount; ++i)
+			{
+				auto result = bases[i].raiseMod(exponents[i], modulus) * bases[i].invertMod(modulus) % modulus;
+				if (backendIndex == 0)
+					expected.push_back(result);
+				else
+					matches = matches && result == expected[i];
+			}
+
+			BigInt result;
+			auto raiseTime = measure([&](std::size_t i) { bases[i % InputCount].raiseMod(exponents[i % InputCount], modulus, result); });
+			auto invertTime = measure([&](std::size_t i) { result = bases[i % InputCount].invertMod(modulus); });
+			auto mulTime = measure([&](std::size_t i) { result = bases[i % InputCount] * bases[(i + 1) % InputCount] % modulus; });
+
+			// Backend with wrong results is never the fastest one, however fast it is
+			raiseTimes.push_back(raiseTime);
+			totalRaiseTimes[backendIndex] += raiseTime;
+			allMatch[backendIndex] = allMatch[backendIndex] && matches;
+			if (matches && raiseTime < raiseTimes[fastest])
+				fastest = backendIndex;
+
+			out << std::left << std::setw(10) << backends[backendIndex]->getName() << std::right << std::fixed << std::setprecision(2)
+				<< std::setw(14) << raiseTime << std::setw(15) << invertTime << std::setw(12) << mulTime
+				<< (matches ? "" : "   RESULTS DIFFER") << '\n';
+		}
+
+		out << "=== Fastest exponentiation: " << backends[fastest]->getName() << '\n';
+	}
+
+	BigInt::setBackend(originalBackend);
+
+	std::size_t fastest = 0;
+	for (std::size_t i = 1; i < backends.size(); ++i)
+	{
+		if (allMatch[i] && totalRaiseTimes[i] < totalRaiseTimes[fastest])
+			fastest = i;
+	}
+
+	return *backends[fastest];
+}
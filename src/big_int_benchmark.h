@@ -0,0 +1,23 @@
+#pragma once
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "big_int.h"
+#include "big_int_backend.h"
+
+struct BigIntBenchmarkCase
+{
+	std::string name;
+	BigInt modulus;
+	std::size_t exponentBits;
+};
+
+/**
+ * Measures modular exponentiation, inversion and multiplication of every backend with every modulus
+ * and writes the results to out. Results of all backends are checked against the first one.
+ * Returns the backend with the lowest total exponentiation time over all cases among those whose results
+ * match in all of them, so the first backend is returned if no other one does.
+ */
+const BigIntBackend& benchmarkBigIntBackends(const std::vector<BigIntBenchmarkCase>& cases, std::ostream& out);
@@ -1,17 +1,37 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <limits>
 #include <memory>
 #include <vector>
 
 #include <openssl/aes.h>
+#include <openssl/crypto.h>
 #include <openssl/evp.h>
-#include <openssl/rand.h>
 
-#include "encrypted_data.h"
+#include "big_int.h"
+#include "error.h"
+#include "random_pool.h"
+#include "span.h"
+
+class DecryptionError : public Error
+{
+public:
+	DecryptionError() noexcept : Error("Unable to decrypt message.") {}
+};
+
+class NonceExhaustedError : public Error
+{
+public:
+	NonceExhaustedError() noexcept : Error("All nonces for the key have been used.") {}
+};
 
 enum Cipher
 {
-	Aes256Cbc
+	Aes256Cbc,
+	Aes256Gcm,
+	ChaCha20Poly1305
 };
 
 template <Cipher C>
@@ -23,67 +43,186 @@ struct CipherTraits<Cipher::Aes256Cbc>
 	using InitFnType = decltype(&EVP_aes_256_cbc);
 
 	constexpr static const InitFnType InitFn = &EVP_aes_256_cbc;
+	constexpr static const std::size_t KeySize = 32;
 	constexpr static const std::size_t BlockSize = AES_BLOCK_SIZE;
 	constexpr static const std::size_t IVSize = AES_BLOCK_SIZE;
+	constexpr static const std::size_t TagSize = 0;
+	constexpr static const bool CounterNonce = false; // CBC needs unpredictable IV
 	constexpr static const char* Name = "AES-256-CBC";
 };
 
+template <>
+struct CipherTraits<Cipher::Aes256Gcm>
+{
+	using InitFnType = decltype(&EVP_aes_256_gcm);
+
+	constexpr static const InitFnType InitFn = &EVP_aes_256_gcm;
+	constexpr static const std::size_t KeySize = 32;
+	constexpr static const std::size_t BlockSize = 1;
+	constexpr static const std::size_t IVSize = 12;
+	constexpr static const std::size_t TagSize = 16;
+	constexpr static const bool CounterNonce = true;
+	constexpr static const char* Name = "AES-256-GCM";
+};
+
+template <>
+struct CipherTraits<Cipher::ChaCha20Poly1305>
+{
+	using InitFnType = decltype(&EVP_chacha20_poly1305);
+
+	constexpr static const InitFnType InitFn = &EVP_chacha20_poly1305;
+	constexpr static const std::size_t KeySize = 32;
+	constexpr static const std::size_t BlockSize = 1;
+	constexpr static const std::size_t IVSize = 12;
+	constexpr static const std::size_t TagSize = 16;
+	constexpr static const bool CounterNonce = true;
+	constexpr static const char* Name = "ChaCha20-Poly1305";
+};
+
+/**
+ * Encrypted payload (sealed data) consists of IV (only if it is not implicit counter nonce),
+ * ciphertext and authentication tag (only for AEAD ciphers). All parts have sizes given
+ * by the cipher, so no lengths are stored.
+ */
 class CipherEngineBase
 {
 public:
-	CipherEngineBase(const BigInt& key) : _impl(EVP_CIPHER_CTX_new(), &EVP_CIPHER_CTX_free), _key(key) {}
+	CipherEngineBase() : _encryptImpl(EVP_CIPHER_CTX_new(), &EVP_CIPHER_CTX_free), _decryptImpl(EVP_CIPHER_CTX_new(), &EVP_CIPHER_CTX_free),
+		_sendCounter(0), _recvCounter(0) {}
+	virtual ~CipherEngineBase() = default;
 
-	virtual EncryptedData encrypt(const Message& msg) const = 0;
-	virtual Message decrypt(const EncryptedData& ciphertext) const = 0;
+	virtual std::size_t getSealedSize(std::size_t plaintextSize) const = 0;
+	virtual std::size_t seal(const Span<std::uint8_t>& plaintext, std::uint8_t* output) const = 0;
+	virtual Span<std::uint8_t> open(std::uint8_t* sealed, std::size_t size) const = 0;
 
 protected:
 	using HandleType = std::unique_ptr<EVP_CIPHER_CTX, decltype(&EVP_CIPHER_CTX_free)>;
 
-	HandleType _impl;
-	BigInt _key;
+	HandleType _encryptImpl;
+	HandleType _decryptImpl;
+	mutable std::uint64_t _sendCounter;
+	mutable std::uint64_t _recvCounter;
 };
 
 template <Cipher C>
 class CipherEngine : public CipherEngineBase
 {
 public:
-	CipherEngine(const BigInt& key) : CipherEngineBase(key)
+	constexpr static const std::size_t TransmittedIVSize = CipherTraits<C>::CounterNonce ? 0 : CipherTraits<C>::IVSize;
+
+	/**
+	 * Both sides share the same key, so for counter nonces each of them needs to know which direction
+	 * it sends in. Initiator sends with direction 0 and receives with direction 1, the other side vice versa.
+	 */
+	CipherEngine(const BigInt& key, bool initiator = true) : CipherEngineBase(), _sendDirection(initiator ? 0 : 1)
 	{
 		EVP_add_cipher(CipherTraits<C>::InitFn());
+
+		// Key is exported into fixed width buffer, so it does not get shorter if it has leading zero bytes
+		auto keyBytes = key.getRawBytes();
+		std::array<std::uint8_t, CipherTraits<C>::KeySize> keyBuffer = {};
+		auto keyLength = std::min(keyBytes.size(), keyBuffer.size());
+		std::copy(keyBytes.end() - keyLength, keyBytes.end(), keyBuffer.end() - keyLength);
+
+		// Key schedule is expanded only once here, every message then only sets its own IV
+		EVP_EncryptInit_ex(_encryptImpl.get(), CipherTraits<C>::InitFn(), nullptr, keyBuffer.data(), nullptr);
+		EVP_DecryptInit_ex(_decryptImpl.get(), CipherTraits<C>::InitFn(), nullptr, keyBuffer.data(), nullptr);
+
+		OPENSSL_cleanse(keyBytes.data(), keyBytes.size());
+		OPENSSL_cleanse(keyBuffer.data(), keyBuffer.size());
 	}
 
-	virtual EncryptedData encrypt(const Message& msg) const override
+	virtual std::size_t getSealedSize(std::size_t plaintextSize) const override
 	{
-		const auto& plaintext = msg.getContent();
-
-		std::vector<std::uint8_t> iv(CipherTraits<C>::IVSize);
-		RAND_bytes(iv.data(), iv.size());
+		// Block ciphers always pad to the next whole block
+		auto ciphertextSize = CipherTraits<C>::BlockSize > 1
+			? (plaintextSize / CipherTraits<C>::BlockSize + 1) * CipherTraits<C>::BlockSize
+			: plaintextSize;
+		return TransmittedIVSize + ciphertextSize + CipherTraits<C>::TagSize;
+	}
 
-		EVP_EncryptInit_ex(_impl.get(), CipherTraits<C>::InitFn(), nullptr, _key.getRawBytes().data(), iv.data());
+	virtual std::size_t seal(const Span<std::uint8_t>& plaintext, std::uint8_t* output) const override
+	{
+		// Counter nonces are implicit and never transmitted, random IVs are sent along with the ciphertext
+		if (CipherTraits<C>::CounterNonce)
+		{
+			auto nonce = makeNonce(_sendDirection, _sendCounter++);
+			EVP_EncryptInit_ex(_encryptImpl.get(), nullptr, nullptr, nullptr, nonce.data());
+		}
+		else
+		{
+			RandomPool::getThreadInstance().generate(output, TransmittedIVSize);
+			EVP_EncryptInit_ex(_encryptImpl.get(), nullptr, nullptr, nullptr, output);
+		}
+
+		auto ciphertext = output + TransmittedIVSize;
 
 		int bytesWritten = 0;
-		std::vector<std::uint8_t> ciphertext(plaintext.size() + CipherTraits<C>::BlockSize);
-		EVP_EncryptUpdate(_impl.get(), ciphertext.data(), &bytesWritten, plaintext.data(), plaintext.size());
+		EVP_EncryptUpdate(_encryptImpl.get(), ciphertext, &bytesWritten, plaintext.getData(), plaintext.getSize());
 
 		int finalBytesWritten = 0;
-		EVP_EncryptFinal_ex(_impl.get(), ciphertext.data() + bytesWritten, &finalBytesWritten);
-		ciphertext.resize(bytesWritten + finalBytesWritten);
+		EVP_EncryptFinal_ex(_encryptImpl.get(), ciphertext + bytesWritten, &finalBytesWritten);
 
-		return { std::move(iv), std::move(ciphertext) };
+		auto tag = ciphertext + bytesWritten + finalBytesWritten;
+		if (CipherTraits<C>::TagSize > 0)
+			EVP_CIPHER_CTX_ctrl(_encryptImpl.get(), EVP_CTRL_AEAD_GET_TAG, CipherTraits<C>::TagSize, tag);
+
+		return tag + CipherTraits<C>::TagSize - output;
 	}
 
-	virtual Message decrypt(const EncryptedData& ciphertext) const override
+	virtual Span<std::uint8_t> open(std::uint8_t* sealed, std::size_t size) const override
 	{
-		EVP_DecryptInit_ex(_impl.get(), CipherTraits<C>::InitFn(), nullptr, _key.getRawBytes().data(), ciphertext.getIV().data());
+		if (size < TransmittedIVSize + CipherTraits<C>::TagSize)
+			throw DecryptionError();
+
+		// Message has to be encrypted with the next expected nonce, so replayed or reordered messages fail to authenticate
+		if (CipherTraits<C>::CounterNonce)
+		{
+			auto nonce = makeNonce(1 - _sendDirection, _recvCounter);
+			EVP_DecryptInit_ex(_decryptImpl.get(), nullptr, nullptr, nullptr, nonce.data());
+		}
+		else
+			EVP_DecryptInit_ex(_decryptImpl.get(), nullptr, nullptr, nullptr, sealed);
+
+		// Plaintext is never longer than ciphertext, so it is decrypted in place
+		auto ciphertext = sealed + TransmittedIVSize;
+		auto ciphertextSize = size - TransmittedIVSize - CipherTraits<C>::TagSize;
 
 		int bytesWritten = 0;
-		std::vector<std::uint8_t> plaintext(ciphertext.getData().size());
-		EVP_DecryptUpdate(_impl.get(), plaintext.data(), &bytesWritten, ciphertext.getData().data(), ciphertext.getData().size());
+		EVP_DecryptUpdate(_decryptImpl.get(), ciphertext, &bytesWritten, ciphertext, ciphertextSize);
+
+		// Tag has to be known before finalization, which verifies it
+		if (CipherTraits<C>::TagSize > 0)
+			EVP_CIPHER_CTX_ctrl(_decryptImpl.get(), EVP_CTRL_AEAD_SET_TAG, CipherTraits<C>::TagSize, ciphertext + ciphertextSize);
 
 		int finalBytesWritten = 0;
-		EVP_DecryptFinal_ex(_impl.get(), plaintext.data() + bytesWritten, &finalBytesWritten);
-		plaintext.resize(bytesWritten + finalBytesWritten);
+		if (EVP_DecryptFinal_ex(_decryptImpl.get(), ciphertext + bytesWritten, &finalBytesWritten) <= 0)
+			throw DecryptionError();
 
-		return plaintext;
+		if (CipherTraits<C>::CounterNonce)
+			++_recvCounter;
+
+		return { ciphertext, static_cast<std::size_t>(bytesWritten + finalBytesWritten) };
+	}
+
+private:
+	// Nonce consists of 32-bit direction followed by 64-bit message counter, both big endian
+	static std::array<std::uint8_t, CipherTraits<C>::IVSize> makeNonce(std::uint32_t direction, std::uint64_t counter)
+	{
+		static_assert(CipherTraits<C>::IVSize >= sizeof(direction) + sizeof(counter), "Nonce is too short for direction and counter.");
+
+		if (counter == std::numeric_limits<std::uint64_t>::max())
+			throw NonceExhaustedError();
+
+		std::array<std::uint8_t, CipherTraits<C>::IVSize> nonce = {};
+		auto pos = nonce.size() - sizeof(counter) - sizeof(direction);
+		for (std::size_t i = 0; i < sizeof(direction); ++i)
+			nonce[pos++] = (direction >> (8 * (sizeof(direction) - i - 1))) & 0xFF;
+		for (std::size_t i = 0; i < sizeof(counter); ++i)
+			nonce[pos++] = (counter >> (8 * (sizeof(counter) - i - 1))) & 0xFF;
+
+		return nonce;
 	}
+
+	std::uint32_t _sendDirection;
 };
@@ -0,0 +1,107 @@
+#include "dh_group.h"
+
+namespace {
+
+const std::size_t MaxWindowBits = 16;
+
+// Number of multiplications is roughly the number of digits plus twice the digit base
+std::size_t optimalWindowBits(std::size_t exponentBits)
+{
+	std::size_t bestWindowBits = 1;
+	std::size_t bestCost = exponentBits + 4;
+	for (std::size_t windowBits = 2; windowBits <= MaxWindowBits; ++windowBits)
+	{
+		std::size_t cost = (exponentBits + windowBits - 1) / windowBits + (std::size_t{1} << (windowBits + 1));
+		if (cost < bestCost)
+		{
+			bestCost = cost;
+			bestWindowBits = windowBits;
+		}
+	}
+
+	return bestWindowBits;
+}
+
+}
+
+DhGroup::DhGroup(const BigInt& generator, const BigInt& modulus) : _generator(generator), _context(modulus),
+	_exponentBits(modulus.getNumberOfBits() - 1), _windowBits(optimalWindowBits(_exponentBits)), _powers()
+{
+	auto digitCount = (_exponentBits + _windowBits - 1) / _windowBits;
+	_powers.reserve(digitCount);
+
+	auto power = _context.toMontgomery(_generator);
+	for (std::size_t i = 0; i < digitCount; ++i)
+	{
+		_powers.push_back(power);
+
+		for (std::size_t j = 0; j < _windowBits; ++j)
+			_context.sqrMod(power, power);
+	}
+}
+
+const BigInt& DhGroup::getGenerator() const
+{
+	return _generator;
+}
+
+const BigInt& DhGroup::getModulus() const
+{
+	return _context.getModulus();
+}
+
+const ModContext& DhGroup::getContext() const
+{
+	return _context;
+}
+
+std::size_t DhGroup::getExponentBits() const
+{
+	return _exponentBits;
+}
+
+BigInt DhGroup::raiseGenerator(const BigInt& exponent) const
+{
+	if (exponent.getSign() < 0 || exponent.getNumberOfBits() > _powers.size() * _windowBits)
+		return _generator.raiseMod(exponent, getModulus());
+
+	auto exp = exponent._impl.get_mpz_t();
+
+	// Split the exponent into w-bit digits
+	std::vector<std::uint32_t> digits(_powers.size());
+	for (std::size_t i = 0; i < digits.size(); ++i)
+	{
+		for (std::size_t j = 0; j < _windowBits; ++j)
+			digits[i] |= static_cast<std::uint32_t>(mpz_tstbit(exp, i * _windowBits + j)) << j;
+	}
+
+	// For every digit value d (from the highest), B accumulates powers of all digits >= d and A accumulates
+	// all the B's, so each power ends up in A exactly d times.
+	BigInt accumulator, bucket;
+	bool accumulatorIsOne = true, bucketIsOne = true;
+	for (std::uint32_t digit = (std::uint32_t{1} << _windowBits) - 1; digit > 0; --digit)
+	{
+		for (std::size_t i = 0; i < digits.size(); ++i)
+		{
+			if (digits[i] != digit)
+				continue;
+
+			if (bucketIsOne)
+				bucket = _powers[i];
+			else
+				_context.mulMod(bucket, _powers[i], bucket);
+			bucketIsOne = false;
+		}
+
+		if (bucketIsOne)
+			continue;
+
+		if (accumulatorIsOne)
+			accumulator = bucket;
+		else
+			_context.mulMod(accumulator, bucket, accumulator);
+		accumulatorIsOne = false;
+	}
+
+	return accumulatorIsOne ? BigInt{1} % getModulus() : _context.fromMontgomery(accumulator);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "big_int.h"
+#include "mod_context.h"
+
+/**
+ * Diffie-Hellman group parameters together with a precomputed table of generator powers.
+ *
+ * The table holds G^(2^(w*i)) mod P for every w-bit digit of the exponent, so raising the
+ * generator to a secret exponent only takes a couple of modular multiplications per digit
+ * (Brickell et al. fixed-base method) instead of a full square-and-multiply exponentiation.
+ */
+class DhGroup
+{
+public:
+	DhGroup(const BigInt& generator, const BigInt& modulus);
+	DhGroup(const DhGroup&) = default;
+	DhGroup(DhGroup&&) = default;
+
+	DhGroup& operator=(const DhGroup&) = default;
+	DhGroup& operator=(DhGroup&&) = default;
+
+	const BigInt& getGenerator() const;
+	const BigInt& getModulus() const;
+	const ModContext& getContext() const;
+	std::size_t getExponentBits() const;
+
+	BigInt raiseGenerator(const BigInt& exponent) const;
+
+private:
+	BigInt _generator;
+	ModContext _context;
+	std::size_t _exponentBits;
+	std::size_t _windowBits;
+	std::vector<BigInt> _powers; // in Montgomery form
+};
@@ -0,0 +1,86 @@
+#include "dh_key_pool.h"
+
+DhKeyPool::DhKeyPool(const DhGroup& group, std::size_t capacity) : _group(group), _capacity(std::max<std::size_t>(capacity, 1)),
+	_pairs(), _mutex(), _notFull(), _stopping(false), _generated(0), _served(0), _misses(0), _refillTime(), _refiller()
+{
+	_refiller = std::thread(&DhKeyPool::refill, this);
+}
+
+DhKeyPool::~DhKeyPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stopping = true;
+	}
+
+	_notFull.notify_one();
+	_refiller.join();
+}
+
+const DhGroup& DhKeyPool::getGroup() const
+{
+	return _group;
+}
+
+DhKeyPool::Metrics DhKeyPool::getMetrics() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	auto refillSeconds = std::chrono::duration<double>(_refillTime).count();
+	return {
+		_pairs.size(),
+		_capacity,
+		_generated,
+		_served,
+		_misses,
+		refillSeconds > 0.0 ? _generated / refillSeconds : 0.0
+	};
+}
+
+DhKeyPair DhKeyPool::acquire()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		++_served;
+		if (!_pairs.empty())
+		{
+			auto keyPair = std::move(_pairs.front());
+			_pairs.pop_front();
+			_notFull.notify_one();
+			return keyPair;
+		}
+
+		++_misses;
+	}
+
+	return generate();
+}
+
+DhKeyPair DhKeyPool::generate() const
+{
+	auto secretExp = BigInt::random(_group.getExponentBits());
+	auto publicKey = _group.raiseGenerator(secretExp);
+	return { std::move(secretExp), std::move(publicKey) };
+}
+
+void DhKeyPool::refill()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	while (true)
+	{
+		_notFull.wait(lock, [this]() { return _stopping || _pairs.size() < _capacity; });
+		if (_stopping)
+			return;
+
+		// Key pair generation is the expensive part, so do not block consumers while it runs
+		lock.unlock();
+		auto startTime = std::chrono::steady_clock::now();
+		auto keyPair = generate();
+		auto elapsedTime = std::chrono::steady_clock::now() - startTime;
+		lock.lock();
+
+		_pairs.push_back(std::move(keyPair));
+		++_generated;
+		_refillTime += elapsedTime;
+	}
+}
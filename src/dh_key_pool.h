@@ -0,0 +1,64 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "big_int.h"
+#include "dh_group.h"
+
+struct DhKeyPair
+{
+	BigInt secretExp;
+	BigInt publicKey;
+};
+
+/**
+ * Pool of ephemeral Diffie-Hellman key pairs kept filled by a background thread.
+ *
+ * Every pair is handed out exactly once. If the pool runs dry, the pair is generated
+ * on the caller's thread and counted as a miss.
+ */
+class DhKeyPool
+{
+public:
+	struct Metrics
+	{
+		std::size_t depth;
+		std::size_t capacity;
+		std::uint64_t generated;
+		std::uint64_t served;
+		std::uint64_t misses;
+		double refillRate; // key pairs generated by the background thread per second of its work
+	};
+
+	DhKeyPool(const DhGroup& group, std::size_t capacity);
+	DhKeyPool(const DhKeyPool&) = delete;
+	~DhKeyPool();
+
+	DhKeyPool& operator=(const DhKeyPool&) = delete;
+
+	const DhGroup& getGroup() const;
+	Metrics getMetrics() const;
+
+	DhKeyPair acquire();
+
+private:
+	DhKeyPair generate() const;
+	void refill();
+
+	const DhGroup& _group;
+	std::size_t _capacity;
+	std::deque<DhKeyPair> _pairs;
+	mutable std::mutex _mutex;
+	std::condition_variable _notFull;
+	bool _stopping;
+	std::uint64_t _generated;
+	std::uint64_t _served;
+	std::uint64_t _misses;
+	std::chrono::steady_clock::duration _refillTime;
+	std::thread _refiller;
+};
@@ -0,0 +1,99 @@
+#include <iomanip>
+
+#include "benchmark.h"
+#include "ffs_benchmark.h"
+#include "parallel.h"
+
+namespace {
+
+// Chunked and tree paths are checked even on hosts with fewer hardware threads
+const std::vector<std::size_t> CheckedThreadCounts = { 1, 2, 3, 4 };
+
+std::vector<BigInt> invertSquaresSequential(const ModContext& ffsContext, const std::vector<BigInt>& keyMont)
+{
+	std::vector<BigInt> result;
+	result.reserve(keyMont.size());
+	for (const auto& s : keyMont)
+		result.push_back(ffsContext.invertMod(ffsContext.sqrMod(s)));
+
+	return result;
+}
+
+std::vector<BigInt> invertSquaresBatch(const ModContext& ffsContext, const std::vector<BigInt>& keyMont)
+{
+	std::vector<BigInt> result;
+	result.reserve(keyMont.size());
+	for (const auto& s : keyMont)
+		result.push_back(ffsContext.sqrMod(s));
+
+	ffsContext.invertModBatch(result);
+	return result;
+}
+
+BigInt productSequential(const ModContext& ffsContext, const std::vector<const BigInt*>& factors)
+{
+	BigInt result = *factors.front();
+	for (std::size_t i = 1; i < factors.size(); ++i)
+		ffsContext.mulMod(result, *factors[i], result);
+
+	return result;
+}
+
+BigInt productTree(const ModContext& ffsContext, const std::vector<const BigInt*>& factors)
+{
+	BigInt result;
+	ffsContext.productMod(factors, result);
+	return result;
+}
+
+}
+
+bool benchmarkFfs(const ModContext& ffsContext, const std::vector<std::size_t>& keyElementCounts, std::ostream& out)
+{
+	auto& pool = ParallelPool::getInstance();
+	auto threadCount = pool.getThreadCount();
+	auto bits = ffsContext.getModulus().getNumberOfBits() - 1;
+
+	out << "=== Feige-Fiat-Shamir with " << ffsContext.getModulus().getNumberOfBits() << "-bit modulus on " << threadCount << " threads\n";
+	out << std::setw(6) << "k" << std::setw(22) << "inversion [us]" << std::setw(22) << "batch inversion [us]" << std::setw(10) << "speedup"
+		<< std::setw(22) << "product [us]" << std::setw(22) << "productMod [us]" << std::setw(10) << "speedup" << '\n';
+
+	bool allMatch = true;
+	for (auto k : keyElementCounts)
+	{
+		std::vector<BigInt> keyMont;
+		std::vector<const BigInt*> factors;
+		keyMont.reserve(k);
+		for (std::size_t i = 0; i < k; ++i)
+			keyMont.push_back(ffsContext.toMontgomery(BigInt::random(bits)));
+		for (const auto& s : keyMont)
+			factors.push_back(&s);
+
+		// Chunks and product tree levels have to give the same results however the work is split
+		auto expectedInverses = invertSquaresSequential(ffsContext, keyMont);
+		auto expectedProduct = productSequential(ffsContext, factors);
+		bool matches = true;
+		for (auto checkedThreadCount : CheckedThreadCounts)
+		{
+			pool.setThreadCount(checkedThreadCount);
+			matches = matches && invertSquaresBatch(ffsContext, keyMont) == expectedInverses && productTree(ffsContext, factors) == expectedProduct;
+		}
+
+		pool.setThreadCount(threadCount);
+		allMatch = allMatch && matches;
+
+		auto inversionTime = measure([&](std::size_t) { invertSquaresSequential(ffsContext, keyMont); });
+		auto batchInversionTime = measure([&](std::size_t) { invertSquaresBatch(ffsContext, keyMont); });
+		auto productTime = measure([&](std::size_t) { productSequential(ffsContext, factors); });
+		auto productModTime = measure([&](std::size_t) { productTree(ffsContext, factors); });
+
+		out << std::setw(6) << k << std::fixed << std::setprecision(1)
+			<< std::setw(22) << inversionTime << std::setw(22) << batchInversionTime
+			<< std::setprecision(2) << std::setw(9) << inversionTime / batchInversionTime << 'x'
+			<< std::setprecision(1) << std::setw(22) << productTime << std::setw(22) << productModTime
+			<< std::setprecision(2) << std::setw(9) << productTime / productModTime << 'x'
+			<< (matches ? "" : "   RESULTS DIFFER") << '\n';
+	}
+
+	return allMatch;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <ostream>
+#include <vector>
+
+#include "mod_context.h"
+
+/**
+ * Measures the client precomputation (squares of the private key inverted by ModContext::invertModBatch()) and
+ * the product of all key elements (ModContext::productMod()) for every given number of key elements, compared
+ * to doing the same one element after another, and writes the results to out. Results are also checked against
+ * the sequential ones with the work split among several threads. Returns false if any of them differs.
+ */
+bool benchmarkFfs(const ModContext& ffsContext, const std::vector<std::size_t>& keyElementCounts, std::ostream& out);
@@ -0,0 +1,73 @@
+#include "ffs_identity.h"
+#include "utils.h"
+
+FfsIdentity::FfsIdentity(const std::string& id, const ModContext& context, const std::vector<BigInt>& privateKey)
+	: _id(id), _context(context), _privateKey(), _publicKey()
+{
+	_privateKey.reserve(privateKey.size());
+	for (const auto& s : privateKey)
+		_privateKey.push_back(_context.toMontgomery(s));
+
+	_publicKey = derivePublicKey(_context, _privateKey);
+}
+
+std::vector<BigInt> FfsIdentity::derivePublicKey(const ModContext& context, const std::vector<BigInt>& privateKeyMont)
+{
+	std::vector<BigInt> publicKey;
+	publicKey.reserve(privateKeyMont.size());
+	for (const auto& s : privateKeyMont)
+		publicKey.push_back(context.sqrMod(s));
+
+	// All squares are inverted at once, which costs a single modular inversion per thread instead of one per element
+	context.invertModBatch(publicKey);
+
+	// Signs are chosen randomly
+	auto signs = randomBits(publicKey.size());
+	for (std::size_t i = 0; i < publicKey.size(); ++i)
+	{
+		context.fromMontgomery(publicKey[i], publicKey[i]);
+		if (signs[i])
+			publicKey[i] = -std::move(publicKey[i]);
+	}
+
+	return publicKey;
+}
+
+const std::string& FfsIdentity::getId() const
+{
+	return _id;
+}
+
+const ModContext& FfsIdentity::getContext() const
+{
+	return _context;
+}
+
+const std::vector<BigInt>& FfsIdentity::getPrivateKey() const
+{
+	return _privateKey;
+}
+
+const std::vector<BigInt>& FfsIdentity::getPublicKey() const
+{
+	return _publicKey;
+}
+
+FfsIdentityRegistry::FfsIdentityRegistry(std::size_t capacity) : _capacity(capacity), _mutex(), _publicKeys()
+{
+}
+
+FfsIdentityRegistry::PublicKeyType FfsIdentityRegistry::find(const std::string& id) const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	auto itr = _publicKeys.find(id);
+	return itr != _publicKeys.end() ? itr->second : nullptr;
+}
+
+void FfsIdentityRegistry::add(const std::string& id, const PublicKeyType& publicKey)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_publicKeys.size() < _capacity)
+		_publicKeys.emplace(id, publicKey);
+}
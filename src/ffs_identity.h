@@ -0,0 +1,59 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "big_int.h"
+#include "mod_context.h"
+
+/**
+ * Feige-Fiat-Shamir identity of the client. Public key vector is derived from the private key
+ * only once, when the identity is created, and reused for all rounds and sessions.
+ */
+class FfsIdentity
+{
+public:
+	FfsIdentity(const std::string& id, const ModContext& context, const std::vector<BigInt>& privateKey);
+
+	// Public key element is +-1/S^2 mod N, private key is expected in Montgomery form and public key is returned in normal form
+	static std::vector<BigInt> derivePublicKey(const ModContext& context, const std::vector<BigInt>& privateKeyMont);
+
+	const std::string& getId() const;
+	const ModContext& getContext() const;
+	const std::vector<BigInt>& getPrivateKey() const;
+	const std::vector<BigInt>& getPublicKey() const;
+
+private:
+	std::string _id;
+	const ModContext& _context;
+	std::vector<BigInt> _privateKey; // in Montgomery form
+	std::vector<BigInt> _publicKey;
+};
+
+/**
+ * Server-side store of public key vectors of registered identities. Shared by all sessions.
+ * Once it holds capacity identities, new ones are not remembered, so they have to send
+ * their public key vector every time they authenticate.
+ */
+class FfsIdentityRegistry
+{
+public:
+	using PublicKeyType = std::shared_ptr<const std::vector<BigInt>>;
+
+	FfsIdentityRegistry(std::size_t capacity);
+	FfsIdentityRegistry(const FfsIdentityRegistry&) = delete;
+
+	FfsIdentityRegistry& operator=(const FfsIdentityRegistry&) = delete;
+
+	PublicKeyType find(const std::string& id) const;
+	// Identity which is already registered keeps its public key
+	void add(const std::string& id, const PublicKeyType& publicKey);
+
+private:
+	std::size_t _capacity;
+	mutable std::mutex _mutex;
+	std::unordered_map<std::string, PublicKeyType> _publicKeys; // in Montgomery form
+};
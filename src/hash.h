@@ -1,38 +1,173 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cctype>
 #include <cstdint>
 #include <iomanip>
+#include <memory>
 #include <sstream>
+#include <string>
+#include <type_traits>
 #include <vector>
 
-#include <openssl/sha.h>
+#include <openssl/evp.h>
 
 #include "big_int.h"
+#include "error.h"
+#include "sha256_batch.h"
 #include "span.h"
 
+class UnknownHashAlgoError : public Error
+{
+public:
+	UnknownHashAlgoError(const std::string& name) noexcept : Error("Unknown hash algorithm '" + name + "'.") {}
+};
+
 enum class HashAlgo
 {
-	Sha256
+	Sha256,
+	Sha512,
+	Sha512_256,
+	Blake2b512
 };
 
+// Calculates digests of all inputs at once and stores them one after another into digests, same as sha256Batch()
+using HashBatchFnType = void (*)(const std::vector<HashPieces>& inputs, std::uint8_t* digests);
+
 template <HashAlgo Algo>
 struct HashTraits {};
 
 template <>
 struct HashTraits<HashAlgo::Sha256>
 {
-	using FnType = decltype(&SHA256);
+	using InitFnType = decltype(&EVP_sha256);
+	using BatchFnType = HashBatchFnType;
+
+	constexpr static const InitFnType InitFn = &EVP_sha256;
+	constexpr static const BatchFnType BatchFn = &sha256Batch;
+	constexpr static const std::size_t DigestSize = 32;
+	constexpr static const char* Name = "SHA-256";
+};
+
+template <>
+struct HashTraits<HashAlgo::Sha512>
+{
+	using InitFnType = decltype(&EVP_sha512);
+	using BatchFnType = HashBatchFnType;
+
+	constexpr static const InitFnType InitFn = &EVP_sha512;
+	constexpr static const BatchFnType BatchFn = nullptr;
+	constexpr static const std::size_t DigestSize = 64;
+	constexpr static const char* Name = "SHA-512";
+};
+
+template <>
+struct HashTraits<HashAlgo::Sha512_256>
+{
+	using InitFnType = decltype(&EVP_sha512_256);
+	using BatchFnType = HashBatchFnType;
+
+	constexpr static const InitFnType InitFn = &EVP_sha512_256;
+	constexpr static const BatchFnType BatchFn = nullptr;
+	constexpr static const std::size_t DigestSize = 32;
+	constexpr static const char* Name = "SHA-512/256";
+};
+
+template <>
+struct HashTraits<HashAlgo::Blake2b512>
+{
+	using InitFnType = decltype(&EVP_blake2b512);
+	using BatchFnType = HashBatchFnType;
+
+	constexpr static const InitFnType InitFn = &EVP_blake2b512;
+	constexpr static const BatchFnType BatchFn = nullptr;
+	constexpr static const std::size_t DigestSize = 64;
+	constexpr static const char* Name = "BLAKE2b-512";
+};
+
+template <HashAlgo Algo>
+using HashAlgoConstant = std::integral_constant<HashAlgo, Algo>;
+
+/**
+ * Calls fn with HashAlgoConstant of the algorithm chosen at runtime, so code templated
+ * by the hash algorithm can be used with the one from configuration.
+ */
+template <typename Fn>
+decltype(auto) withHashAlgo(HashAlgo algo, Fn&& fn)
+{
+	switch (algo)
+	{
+		case HashAlgo::Sha512:
+			return fn(HashAlgoConstant<HashAlgo::Sha512>{});
+		case HashAlgo::Sha512_256:
+			return fn(HashAlgoConstant<HashAlgo::Sha512_256>{});
+		case HashAlgo::Blake2b512:
+			return fn(HashAlgoConstant<HashAlgo::Blake2b512>{});
+		case HashAlgo::Sha256:
+			return fn(HashAlgoConstant<HashAlgo::Sha256>{});
+	}
+
+	// No default case above, so the compiler warns about algorithms missing there
+	throw UnknownHashAlgoError(std::to_string(static_cast<int>(algo)));
+}
+
+// Finds the algorithm by its name (case does not matter)
+inline HashAlgo getHashAlgo(const std::string& name)
+{
+	for (auto algo : { HashAlgo::Sha256, HashAlgo::Sha512, HashAlgo::Sha512_256, HashAlgo::Blake2b512 })
+	{
+		std::string algoName = withHashAlgo(algo, [](auto algoConstant) { return HashTraits<decltype(algoConstant)::value>::Name; });
+		if (std::equal(name.begin(), name.end(), algoName.begin(), algoName.end(),
+					[](char lhs, char rhs) { return std::tolower(lhs) == std::tolower(rhs); }))
+			return algo;
+	}
+
+	throw UnknownHashAlgoError(name);
+}
+
+/**
+ * Hashes data fed to it piece by piece, so it does not have to be in one contiguous buffer.
+ * Context can be used again once final() is called.
+ */
+template <HashAlgo Algo>
+class HashContext
+{
+public:
+	HashContext() : _impl(EVP_MD_CTX_new(), &EVP_MD_CTX_free)
+	{
+		EVP_DigestInit_ex(_impl.get(), HashTraits<Algo>::InitFn(), nullptr);
+	}
+
+	HashContext(const HashContext&) = delete;
+	HashContext(HashContext&&) = default;
+
+	HashContext& operator=(const HashContext&) = delete;
+	HashContext& operator=(HashContext&&) = default;
 
-	constexpr static const FnType Fn = &SHA256;
-	constexpr static const std::size_t DigestSize = SHA256_DIGEST_LENGTH;
+	void update(const Span<std::uint8_t>& data)
+	{
+		EVP_DigestUpdate(_impl.get(), data.getData(), data.getSize());
+	}
+
+	BigInt final()
+	{
+		std::array<std::uint8_t, HashTraits<Algo>::DigestSize> digest;
+		EVP_DigestFinal_ex(_impl.get(), digest.data(), nullptr);
+		EVP_DigestInit_ex(_impl.get(), nullptr, nullptr);
+		return { digest.data(), digest.size() };
+	}
+
+private:
+	std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> _impl;
 };
 
 template <HashAlgo Algo>
 BigInt hash(const Span<std::uint8_t>& data)
 {
-	std::vector<std::uint8_t> result(HashTraits<Algo>::DigestSize);
-	(*HashTraits<Algo>::Fn)(data.getData(), data.getSize(), result.data());
-	return result;
+	std::array<std::uint8_t, HashTraits<Algo>::DigestSize> digest;
+	EVP_Digest(data.getData(), data.getSize(), digest.data(), nullptr, HashTraits<Algo>::InitFn(), nullptr);
+	return { digest.data(), digest.size() };
 }
 
 template <HashAlgo Algo>
@@ -41,6 +176,37 @@ BigInt hash(const std::vector<std::uint8_t>& data)
 	return hash<Algo>({data.data(), data.size()});
 }
 
+// Hashes all inputs together, which is much faster than hashing them one by one if there are many short ones
+template <HashAlgo Algo>
+std::vector<BigInt> hashBatch(const std::vector<HashPieces>& inputs)
+{
+	const std::size_t digestSize = HashTraits<Algo>::DigestSize;
+	std::vector<BigInt> result;
+	if (HashTraits<Algo>::BatchFn == nullptr)
+	{
+		// There is no batch implementation, so at least the context is shared
+		HashContext<Algo> context;
+		result.reserve(inputs.size());
+		for (const auto& pieces : inputs)
+		{
+			for (const auto& piece : pieces)
+				context.update(piece);
+			result.push_back(context.final());
+		}
+
+		return result;
+	}
+
+	std::vector<std::uint8_t> digests(inputs.size() * digestSize);
+	(*HashTraits<Algo>::BatchFn)(inputs, digests.data());
+
+	result.reserve(inputs.size());
+	for (std::size_t i = 0; i < inputs.size(); ++i)
+		result.emplace_back(digests.data() + i * digestSize, digestSize);
+
+	return result;
+}
+
 template <HashAlgo Algo>
 std::string hashToString(const BigInt& hashValue)
 {
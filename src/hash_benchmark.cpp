@@ -0,0 +1,56 @@
+#include <iomanip>
+
+#include <openssl/evp.h>
+
+#include "benchmark.h"
+#include "hash_benchmark.h"
+#include "random_pool.h"
+#include "sha256_batch.h"
+
+namespace {
+
+const std::size_t BurstSize = 64;
+const std::size_t DigestSize = 32;
+
+}
+
+bool benchmarkSha256Batch(const std::vector<std::size_t>& messageSizes, std::ostream& out)
+{
+	out << "=== SHA-256 of bursts of " << BurstSize << " messages\n";
+	out << std::setw(10) << "size [B]" << std::setw(20) << "batch [digests/s]" << std::setw(23) << "one-shot [digests/s]" << std::setw(10) << "speedup" << '\n';
+
+	bool allMatch = true;
+	for (auto size : messageSizes)
+	{
+		std::vector<std::vector<std::uint8_t>> messages(BurstSize, std::vector<std::uint8_t>(size));
+		std::vector<HashPieces> inputs;
+		inputs.reserve(BurstSize);
+		for (auto& message : messages)
+		{
+			RandomPool::getThreadInstance().generate(message.data(), message.size());
+			inputs.push_back({{message.data(), message.size()}});
+		}
+
+		// One-shot digest is what every message used to be hashed with
+		std::vector<std::uint8_t> batchDigests(BurstSize * DigestSize), oneShotDigests(BurstSize * DigestSize);
+		auto hashOneShot = [&]() {
+			for (std::size_t i = 0; i < BurstSize; ++i)
+				EVP_Digest(messages[i].data(), messages[i].size(), oneShotDigests.data() + i * DigestSize, nullptr, EVP_sha256(), nullptr);
+		};
+
+		sha256Batch(inputs, batchDigests.data());
+		hashOneShot();
+		bool matches = batchDigests == oneShotDigests;
+		allMatch = allMatch && matches;
+
+		auto batchTime = measure([&](std::size_t) { sha256Batch(inputs, batchDigests.data()); });
+		auto oneShotTime = measure([&](std::size_t) { hashOneShot(); });
+
+		out << std::setw(10) << size << std::fixed << std::setprecision(0)
+			<< std::setw(20) << BurstSize * 1e6 / batchTime << std::setw(23) << BurstSize * 1e6 / oneShotTime
+			<< std::setprecision(2) << std::setw(9) << oneShotTime / batchTime << 'x'
+			<< (matches ? "" : "   DIGESTS DIFFER") << '\n';
+	}
+
+	return allMatch;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <ostream>
+#include <vector>
+
+/**
+ * Measures how many SHA-256 digests per second sha256Batch() computes for bursts of messages of every given size,
+ * compared to one-shot hashing of the same messages one by one, and writes the results to out.
+ * Returns false if any of the batch digests differs from the one-shot one.
+ */
+bool benchmarkSha256Batch(const std::vector<std::size_t>& messageSizes, std::ostream& out);
@@ -1,14 +1,33 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
 #include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
 #include <vector>
 
 #include "big_int.h"
+#include "big_int_backend.h"
+#include "big_int_benchmark.h"
 #include "cipher_engine.h"
+#include "dh_group.h"
+#include "dh_key_pool.h"
+#include "ffs_benchmark.h"
+#include "ffs_identity.h"
 #include "hash.h"
+#include "hash_benchmark.h"
+#include "mod_context.h"
 #include "service.h"
 
 const auto socketPath = "/tmp/kry-xmilko01.socket";
 
 // Diffie_Hellman parameters
+const auto channelCipher = Cipher::Aes256Gcm;
+const auto defaultChannelHash = "SHA-256"; // can be overridden by KRY_HASH environment variable
+const auto defaultBigIntBackend = "GMP"; // can be overridden by KRY_BIGINT environment variable
 const auto dhGenerator = "2"_bigint;
 const auto dhModulus = "0xFFFFFFFFFFFFFFFFC90FDAA22168C234C4C6628B80DC1CD1"
 	"29024E088A67CC74020BBEA63B139B22514A08798E3404DD"
@@ -21,9 +40,43 @@ const auto dhModulus = "0xFFFFFFFFFFFFFFFFC90FDAA22168C234C4C6628B80DC1CD1"
 	"E39E772C180E86039B2783A2EC07A28FB5C55DF06F4C52C9"
 	"DE2BCBF6955817183995497CEA956AE515D2261898FA0510"
 	"15728E5A8AACAA68FFFFFFFFFFFFFFFF"_bigint;
+const auto dhGroup = DhGroup{dhGenerator, dhModulus};
+const auto benchmarkDhModulus = "0xFFFFFFFFFFFFFFFFC90FDAA22168C234C4C6628B80DC1CD1"
+	"29024E088A67CC74020BBEA63B139B22514A08798E3404DD"
+	"EF9519B3CD3A431B302B0A6DF25F14374FE1356D6D51C245"
+	"E485B576625E7EC6F44C42E9A637ED6B0BFF5CB6F406B7ED"
+	"EE386BFB5A899FA5AE9F24117C4B1FE649286651ECE45B3D"
+	"C2007CB8A163BF0598DA48361C55D39A69163FA8FD24CF5F"
+	"83655D23DCA3AD961C62F356208552BB9ED529077096966D"
+	"670C354E4ABC9804F1746C08CA18217C32905E462E36CE3B"
+	"E39E772C180E86039B2783A2EC07A28FB5C55DF06F4C52C9"
+	"DE2BCBF6955817183995497CEA956AE515D2261898FA0510"
+	"15728E5A8AAAC42DAD33170D04507A33A85521ABDF1CBA64"
+	"ECFB850458DBEF0A8AEA71575D060C7DB3970F85A6E1E4C7"
+	"ABF5AE8CDB0933D71E8C94E04A25619DCEE3D2261AD2EE6B"
+	"F12FFA06D98A0864D87602733EC86A64521F2B18177B200C"
+	"BBE117577A615D6C770988C0BAD946E208E24FA074E5AB31"
+	"43DB5BFCE0FD108E4B82D120A93AD2CAFFFFFFFFFFFFFFFF"_bigint; // 3072-bit MODP group from RFC 3526, only used by the backend benchmark
+
+const auto keyPoolCapacity = 32;
+
+// Clients which stop talking are disconnected, so they do not hold a worker of the multi-session server forever
+const auto handshakeTimeout = std::chrono::seconds(10); // key exchange and authentication
+const auto sessionIdleTimeout = std::chrono::minutes(5); // between messages, multi-session server only
+// Servers without protocol negotiation read frames which arrive together with our public key before they set up their cipher
+const auto legacyServerDelay = std::chrono::milliseconds(50);
+
+// Message sizes (in bytes) measured by the hash benchmark
+const auto hashBenchmarkSizes = std::vector<std::size_t>{ 8, 64, 256, 1024, 16384 };
 
 // Feige-Fiat-Shamir parameters
 const auto authenticationTries = 4;
+const auto batchedAuthentication = true; // all tries in a single witness/challenge/evidence exchange
+const auto registeredIdentity = true; // server remembers public key vector of the client identity
+const auto authenticationRounds = batchedAuthentication ? authenticationTries : 1;
+const auto authenticationExchanges = batchedAuthentication ? 1 : authenticationTries;
+const auto ffsIdentityId = "xmilko01";
+const auto identityRegistryCapacity = 1024; // identities remembered by the server
 const auto ffsN = "6854094740328716964537162194987044147141068353435567001423495886123986431524484180445077931935555842918624004333312819870"
 	"768234350338831770704569330358466595153891946219009802123179173846336429131525643935623013369566827022032382397164259862427478592037668"
 	"806680871173899594707261102765034694450679268176745975368118568508461153092679300169555029731508192995713218354934548201765849829866564"
@@ -46,98 +99,281 @@ const auto ffsS = std::vector<BigInt>{
 		"64987829414721871273044413071629544628638710464916371816036580416416817070896269491500551737921441363159992115746550168590679593655"
 		"3844375731335252153836344762325956046790606"_bigint
 };
+const auto ffsContext = ModContext{ffsN};
+// Numbers of key elements measured by the FFS benchmark
+const auto ffsBenchmarkKeySizes = std::vector<std::size_t>{ 5, 64, 256, 1024 };
 
-bool server()
+FfsIdentityRegistry identityRegistry{identityRegistryCapacity};
+
+std::mutex outputMutex;
+
+void writeValues(std::ostream&) {}
+
+template <typename T, typename... Ts>
+void writeValues(std::ostream& out, const T& value, const Ts&... values)
 {
-	Server server(socketPath);
+	out << value;
+	writeValues(out, values...);
+}
+
+// Whole line is written at once, so lines of sessions served by different worker threads do not interleave
+template <typename... Ts>
+void printLine(std::ostream& out, const Ts&... values)
+{
+	std::ostringstream line;
+	writeValues(line, values...);
+	line << '\n';
+
+	std::lock_guard<std::mutex> lock(outputMutex);
+	out << line.str() << std::flush;
+}
+
+// Every burst of messages from the client is hashed at once and the hashes are sent back
+template <HashAlgo Hash>
+void serveMessages(Service& server, const std::string& prefix, FramingVersion hashFraming)
+{
+	while (true)
+	{
+		server.receiveBurst(
+				[&](const std::vector<const Message*>& msgs) {
+					auto msgHashes = Message::getHashes<Hash>(msgs, hashFraming);
+					for (std::size_t i = 0; i < msgs.size(); ++i)
+					{
+						auto str = msgs[i]->read<std::string>();
+						printLine(std::cout, prefix, "Received: ", str, " (", hashToString<Hash>(msgHashes[i]), ')');
+						server.send(msgHashes[i]);
+					}
+				}
+			);
+	}
+}
+
+template <HashAlgo Hash>
+bool serveSession(Service& server, const std::string& sessionName = {}, DhKeyPool* keyPool = nullptr,
+		std::chrono::milliseconds idleTimeout = std::chrono::milliseconds(0))
+{
+	// Sessions of multi-session server are told apart by their names
+	auto prefix = sessionName.empty() ? std::string("=== ") : "=== [" + sessionName + "] ";
 
 	try
 	{
-		std::cout << "=== Staring server and waiting for client..." << std::endl;
-		server.start();
+		server.setReceiveTimeout(handshakeTimeout);
+		printLine(std::cout, prefix, "Starting Diffie-Hellman key exchange...");
+		if (keyPool != nullptr)
+		{
+			server.createSecuredChannel<channelCipher, Hash>(*keyPool);
 
-		std::cout << "=== Starting Diffie-Hellman key exchange..." << std::endl;
-		server.createSecuredChannel<Cipher::Aes256Cbc, HashAlgo::Sha256>(dhGenerator, dhModulus);
-		std::cout << "=== Diffie-Hellman key exchange completed. All communication is now encrypted with " << CipherTraits<Cipher::Aes256Cbc>::Name << '.' << std::endl;
+			auto metrics = keyPool->getMetrics();
+			printLine(std::cout, prefix, "Key pool: ", metrics.depth, '/', metrics.capacity, " pairs ready, ",
+				metrics.misses, " misses, refill rate ", metrics.refillRate, " pairs/s");
+		}
+		else
+			server.createSecuredChannel<channelCipher, Hash>(dhGroup);
+
+		// Clients without protocol negotiation get the original protocol with one authentication round per exchange
+		auto legacyPeer = server.isLegacyPeer();
+		auto cipherName = legacyPeer ? CipherTraits<Service::LegacyCipher>::Name : CipherTraits<channelCipher>::Name;
+		printLine(std::cout, prefix, "Diffie-Hellman key exchange completed. All communication is now encrypted with ", std::string(cipherName), '.');
 
-		for (auto i = 0; i < authenticationTries; ++i)
+		auto exchanges = legacyPeer ? authenticationTries : authenticationExchanges;
+		auto rounds = legacyPeer ? 1 : authenticationRounds;
+		for (auto i = 0; i < exchanges; ++i)
 		{
-			std::cout << "=== Authenticating client... ";
-			if (!server.verifyAuthentication(ffsN, ffsS.size()))
-			{
-				std::cout << "FAIL" << std::endl;
+			bool authenticated = false;
+			if (registeredIdentity && !legacyPeer)
+				authenticated = server.verifyIdentity(ffsContext, identityRegistry, ffsS.size(), rounds);
+			else if (batchedAuthentication && !legacyPeer)
+				authenticated = server.verifyAuthenticationBatch(ffsContext, ffsS.size(), rounds);
+			else
+				authenticated = server.verifyAuthentication(ffsContext, ffsS.size());
+
+			auto roundsInfo = rounds > 1 ? " (" + std::to_string(rounds) + " rounds at once)" : std::string();
+			printLine(std::cout, prefix, "Authenticating client", roundsInfo, "... ", authenticated ? "OK" : "FAIL");
+			if (!authenticated)
 				return false;
-			}
-			std::cout << "OK" << std::endl;
 		}
 
 		// Message exchange
-		while (true)
-		{
-			server.receive(
-					[&](const Message* msg) {
-						auto str = msg->read<std::string>();
-						auto msgHash = msg->getHash<HashAlgo::Sha256>();
-						std::cout << "=== Received: " << str << " (" << hashToString<HashAlgo::Sha256>(msgHash) << ')' << std::endl;
-						server.send(msgHash);
-					}
-				);
-		}
+		server.setReceiveTimeout(idleTimeout);
+		if (legacyPeer)
+			serveMessages<Service::LegacyHash>(server, prefix, FramingV1);
+		else
+			serveMessages<Hash>(server, prefix, FramingV2);
 	}
 	catch(const ConnectionClosedError&)
 	{
 	}
 	catch(const ConnectionFailureError&)
 	{
-		std::cerr << "=== Client disconnected unexpectedly.\n";
+		printLine(std::cerr, prefix, "Client disconnected unexpectedly.");
+		return false;
+	}
+	catch(const ConnectionTimeoutError&)
+	{
+		printLine(std::cerr, prefix, "Client did not respond in time.");
+		return false;
+	}
+	catch(const DecryptionError&)
+	{
+		printLine(std::cerr, prefix, "Unable to decrypt message from client.");
+		return false;
+	}
+	catch(const FrameTooLongError&)
+	{
+		printLine(std::cerr, prefix, "Client sent message which is too long.");
+		return false;
+	}
+	catch(const IncompatibleProtocolError&)
+	{
+		printLine(std::cerr, prefix, "Client does not speak compatible protocol.");
+		return false;
+	}
+	catch(const ElementOutOfRangeError&)
+	{
+		printLine(std::cerr, prefix, "Client sent value which is out of range of its group.");
+		return false;
+	}
+
+	return true;
+}
+
+template <HashAlgo Hash>
+bool server()
+{
+	Server server(socketPath);
+
+	try
+	{
+		std::cout << "=== Staring server and waiting for client..." << std::endl;
+		server.start();
+	}
+	catch(const ConnectionFailureError&)
+	{
+		std::cerr << "=== Unable to accept client.\n";
+		return false;
+	}
+
+	return serveSession<Hash>(server);
+}
+
+template <HashAlgo Hash>
+bool multiSessionServer(std::size_t threadCount)
+{
+	DhKeyPool keyPool(dhGroup, keyPoolCapacity);
+	SessionServer server(socketPath, threadCount);
+	std::atomic<std::size_t> sessionCount{0};
+
+	try
+	{
+		std::cout << "=== Staring server with " << threadCount << " worker threads and waiting for clients..." << std::endl;
+		server.run(
+				[&](Session& session) { serveSession<Hash>(session, "session " + std::to_string(++sessionCount), &keyPool, sessionIdleTimeout); },
+				[](const std::string& message) { printLine(std::cerr, "=== ", message); }
+			);
+	}
+	catch(const ConnectionFailureError&)
+	{
+		std::cerr << "=== Unable to accept client.\n";
 		return false;
 	}
 
 	return true;
 }
 
+// Every line of the input is sent to the server, which has to send back its hash. Returns once hashes differ or input ends.
+template <HashAlgo Hash>
+void sendLines(Service& client, FramingVersion hashFraming)
+{
+	bool keepAlive = true;
+	std::string line;
+	while (keepAlive && std::getline(std::cin, line))
+	{
+		auto sentMsg = client.send(line);
+		auto sentMsgHash = sentMsg.getHash<Hash>(hashFraming);
+		std::cout << "=== Sent: " << line << " (" << hashToString<Hash>(sentMsgHash) << ')' << std::endl;
+		keepAlive = client.receive(
+				[&](const Message* msg) {
+					auto recvdHash = msg->read<BigInt>();
+					bool hashesEqual = sentMsgHash == recvdHash;
+					std::cout << "=== Comparing hashes... " << (hashesEqual ? "OK" : "MISMATCH") << std::endl;
+					return hashesEqual;
+				}
+			);
+	}
+}
+
+template <HashAlgo Hash>
 bool client()
 {
 	Client client(socketPath);
+	FfsIdentity ffsIdentity(ffsIdentityId, ffsContext, ffsS);
+	bool secured = false;
 
 	try
 	{
 		client.start();
 
 		std::cout << "=== Starting Diffie-Hellman key exchange..." << std::endl;
-		client.createSecuredChannel<Cipher::Aes256Cbc, HashAlgo::Sha256>(dhGenerator, dhModulus);
-		std::cout << "=== Diffie-Hellman key exchange completed. All communication is now encrypted with " << CipherTraits<Cipher::Aes256Cbc>::Name << '.' << std::endl;
+		client.createSecuredChannel<channelCipher, Hash>(dhGroup);
+		secured = true;
 
-		for (auto i = 0; i < authenticationTries; ++i)
+		// Servers without protocol negotiation get the original protocol with one authentication round per exchange
+		auto legacyPeer = client.isLegacyPeer();
+		auto cipherName = legacyPeer ? CipherTraits<Service::LegacyCipher>::Name : CipherTraits<channelCipher>::Name;
+		std::cout << "=== Diffie-Hellman key exchange completed. All communication is now encrypted with " << cipherName << '.' << std::endl;
+		if (legacyPeer)
+			std::this_thread::sleep_for(legacyServerDelay);
+
+		auto exchanges = legacyPeer ? authenticationTries : authenticationExchanges;
+		for (auto i = 0; i < exchanges; ++i)
 		{
 			std::cout << "=== Sending authentication info to server..." << std::endl;
-			client.authenticate(ffsN, ffsS);
+			if (registeredIdentity && !legacyPeer)
+				client.authenticateIdentity(ffsIdentity, authenticationRounds);
+			else if (batchedAuthentication && !legacyPeer)
+				client.authenticateBatch(ffsContext, ffsS, authenticationRounds);
+			else
+				client.authenticate(ffsContext, ffsS);
 		}
 
 		std::cout << "=== Awaiting input..." << std::endl;
-		bool keepAlive = true;
-		std::string line;
-		while (keepAlive && std::getline(std::cin, line))
-		{
-			auto sentMsg = client.send(line);
-			auto sentMsgHash = sentMsg.getHash<HashAlgo::Sha256>();
-			std::cout << "=== Sent: " << line << " (" << hashToString<HashAlgo::Sha256>(sentMsgHash) << ')' << std::endl;
-			keepAlive = client.receive(
-					[&](const Message* msg) {
-						auto recvdHash = msg->read<BigInt>();
-						bool hashesEqual = sentMsgHash == recvdHash;
-						std::cout << "=== Comparing hashes... " << (hashesEqual ? "OK" : "MISMATCH") << std::endl;
-						return hashesEqual;
-					}
-				);
-		}
+		if (legacyPeer)
+			sendLines<Service::LegacyHash>(client, FramingV1);
+		else
+			sendLines<Hash>(client, FramingV2);
 	}
 	catch(const ConnectionClosedError&)
 	{
+		// Busy multi-session server refuses clients right after accepting them
+		if (!secured)
+		{
+			std::cerr << "=== Server closed the connection before the key exchange, it may be busy.\n";
+			return false;
+		}
 	}
 	catch(const ConnectionFailureError&)
 	{
-		std::cerr << "=== Server disconnected unexpectedly.\n";
+		std::cerr << (secured ? "=== Server disconnected unexpectedly.\n" : "=== Server closed the connection before the key exchange, it may be busy.\n");
+		return false;
+	}
+	catch(const DecryptionError&)
+	{
+		std::cerr << "=== Unable to decrypt message from server.\n";
+		return false;
+	}
+	catch(const FrameTooLongError&)
+	{
+		std::cerr << "=== Message is too long to be sent.\n";
+		return false;
+	}
+	catch(const IncompatibleProtocolError&)
+	{
+		std::cerr << "=== Server does not speak compatible protocol.\n";
+		return false;
+	}
+	catch(const ElementOutOfRangeError&)
+	{
+		std::cerr << "=== Server sent value which is out of range of its group.\n";
 		return false;
 	}
 	catch(const UnableToConnectError&)
@@ -149,17 +385,88 @@ bool client()
 	return true;
 }
 
+// Number of worker threads has to be a positive decimal number
+bool parseThreadCount(const std::string& str, std::size_t& threadCount)
+{
+	if (str.empty() || !std::all_of(str.begin(), str.end(), [](char c) { return std::isdigit(static_cast<unsigned char>(c)) != 0; }))
+		return false;
+
+	try
+	{
+		threadCount = std::stoul(str);
+	}
+	catch(const std::logic_error&)
+	{
+		return false;
+	}
+
+	return threadCount > 0;
+}
+
 int main(int argc, char* argv[])
 {
 	std::vector<std::string> args(argv + 1, argv + argc);
-	if (args.size() != 1)
+	if (args.empty())
 		return 1;
 
+	HashAlgo channelHash;
+	try
+	{
+		auto hashName = std::getenv("KRY_HASH");
+		channelHash = getHashAlgo(hashName != nullptr ? hashName : defaultChannelHash);
+	}
+	catch(const UnknownHashAlgoError& error)
+	{
+		std::cerr << "=== " << error.what() << '\n';
+		return 1;
+	}
+
+	try
+	{
+		auto backendName = std::getenv("KRY_BIGINT");
+		BigInt::setBackend(getBigIntBackend(backendName != nullptr ? backendName : defaultBigIntBackend));
+	}
+	catch(const UnknownBigIntBackendError& error)
+	{
+		std::cerr << "=== " << error.what() << '\n';
+		return 1;
+	}
+
 	bool ok = true;
-	if (args[0] == "-s")
-		ok = server();
-	else if (args[0] == "-c")
-		ok = client();
+	if (args[0] == "-s" && args.size() == 1)
+		ok = withHashAlgo(channelHash, [](auto hash) { return server<decltype(hash)::value>(); });
+	else if (args[0] == "-m" && args.size() <= 2)
+	{
+		std::size_t threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+		if (args.size() == 2 && !parseThreadCount(args[1], threadCount))
+		{
+			std::cerr << "=== Invalid number of worker threads '" << args[1] << "'.\n";
+			return 1;
+		}
+
+		ok = withHashAlgo(channelHash, [&](auto hash) { return multiSessionServer<decltype(hash)::value>(threadCount); });
+	}
+	else if (args[0] == "-c" && args.size() == 1)
+		ok = withHashAlgo(channelHash, [](auto hash) { return client<decltype(hash)::value>(); });
+	else if (args[0] == "-b" && args.size() <= 2)
+	{
+		auto benchmark = args.size() == 2 ? args[1] : "bigint";
+		if (benchmark == "bigint")
+		{
+			const auto& fastest = benchmarkBigIntBackends({
+					{ "Diffie-Hellman", dhModulus, dhGroup.getExponentBits() },
+					{ "Diffie-Hellman 3072", benchmarkDhModulus, benchmarkDhModulus.getNumberOfBits() - 1 },
+					{ "Feige-Fiat-Shamir", ffsN, ffsN.getNumberOfBits() }
+				}, std::cout);
+			std::cout << "=== Fastest backend on this host: " << fastest.getName() << " (set KRY_BIGINT to use it)" << std::endl;
+		}
+		else if (benchmark == "hash")
+			ok = benchmarkSha256Batch(hashBenchmarkSizes, std::cout);
+		else if (benchmark == "ffs")
+			ok = benchmarkFfs(ffsContext, ffsBenchmarkKeySizes, std::cout);
+		else
+			return 1;
+	}
 	else
 		return 1;
 
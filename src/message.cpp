@@ -1,82 +1,437 @@
+#include <boost/iterator/function_output_iterator.hpp>
+
 #include "message.h"
 
-Message::Message() : _data(), _readPos(), _writePos()
+Message::Message() : _data(), _view(nullptr), _viewSize(0), _readPos(0), _writePos(0), _wireFormat(WireFormatV1)
+{
+}
+
+Message::Message(const std::vector<std::uint8_t>& data) : _data(data), _view(nullptr), _viewSize(0), _readPos(0), _writePos(0), _wireFormat(WireFormatV1)
+{
+}
+
+Message::Message(std::vector<std::uint8_t>&& data) : _data(std::move(data)), _view(nullptr), _viewSize(0), _readPos(0), _writePos(0), _wireFormat(WireFormatV1)
+{
+}
+
+std::size_t Message::getHeaderSize(FramingVersion version)
+{
+	return version == FramingV1 ? sizeof(std::uint16_t) : sizeof(std::uint32_t);
+}
+
+std::size_t Message::getMaxPayloadSize(FramingVersion version)
+{
+	return version == FramingV1 ? std::numeric_limits<std::uint16_t>::max() : MaxFrameSize;
+}
+
+bool Message::peekPayloadSize(const Span<std::uint8_t>& buffer, std::size_t& payloadSize, FramingVersion version)
+{
+	auto headerSize = getHeaderSize(version);
+	if (buffer.getSize() < headerSize)
+		return false;
+
+	auto header = view({buffer.getData(), headerSize});
+	payloadSize = version == FramingV1 ? header.read<std::uint16_t>() : header.read<std::uint32_t>();
+
+	// Do not let the other side make us allocate arbitrarily large receive buffer
+	if (payloadSize > getMaxPayloadSize(version))
+		throw FrameTooLongError();
+
+	return true;
+}
+
+Message Message::view(const Span<std::uint8_t>& payload)
+{
+	Message result;
+	result._view = payload.getData();
+	result._viewSize = payload.getSize();
+	return result;
+}
+
+void Message::writeHeader(std::uint8_t* output, std::size_t payloadSize, FramingVersion version)
+{
+	if (payloadSize > getMaxPayloadSize(version))
+		throw FrameTooLongError();
+
+	if (version == FramingV1)
+	{
+		auto header = static_cast<std::uint16_t>(payloadSize);
+		std::memcpy(output, &header, sizeof(header));
+	}
+	else
+	{
+		auto header = static_cast<std::uint32_t>(payloadSize);
+		std::memcpy(output, &header, sizeof(header));
+	}
+}
+
+std::size_t Message::getSerializedSize(const std::string& str)
+{
+	return sizeof(LengthPrefixedStringTag) + sizeof(std::uint32_t) + str.size();
+}
+
+std::size_t Message::getSerializedSize(const boost::dynamic_bitset<std::uint64_t>& bitset)
+{
+	return sizeof(LengthPrefixedStringTag) + sizeof(std::uint32_t) + bitset.size();
+}
+
+std::size_t Message::getSerializedSize(const BigInt& bigint)
+{
+	// Sign is followed by the sequence of bytes, the number of bits may overestimate zero by one byte
+	auto byteCount = (bigint.getNumberOfBits() + 7) / 8;
+	return sizeof(std::int8_t) + getSequenceHeaderSize(byteCount) + byteCount;
+}
+
+std::size_t Message::getSerializedSize(const GroupElement& element)
+{
+	return std::max(getSerializedSize(element.value), getElementSize(element.modulus));
+}
+
+std::size_t Message::getSequenceHeaderSize(std::size_t count)
+{
+	return count <= 0x7F ? 1 : (count <= 0x3FFF ? 2 : 4);
+}
+
+std::size_t Message::getElementSize(const BigInt& modulus)
+{
+	return (modulus.getNumberOfBits() + 7) / 8;
+}
+
+void Message::assign(const Span<std::uint8_t>& content)
+{
+	_data.assign(content.getData(), content.getData() + content.getSize());
+	_view = nullptr;
+	_viewSize = 0;
+	_readPos = 0;
+	_writePos = 0;
+}
+
+void Message::clear()
+{
+	std::fill(_data.begin(), _data.end(), 0); // do not leave old content in memory which is going to be reused
+	_data.clear();
+	_view = nullptr;
+	_viewSize = 0;
+	_readPos = 0;
+	_writePos = 0;
+}
+
+void Message::reserve(std::size_t size)
+{
+	if (_view != nullptr)
+		detach();
+
+	_data.reserve(_writePos + size);
+}
+
+std::size_t Message::getTotalSize(FramingVersion version) const
 {
+	return getHeaderSize(version) + getContent().getSize();
 }
 
-Message::Message(const std::vector<std::uint8_t>& data) : _data(data), _readPos(0), _writePos(0)
+Span<std::uint8_t> Message::getContent() const
 {
+	return _view != nullptr ? Span<std::uint8_t>{_view, _viewSize} : Span<std::uint8_t>{_data.data(), _data.size()};
 }
 
-Message::Message(std::vector<std::uint8_t>&& data) : _data(std::move(data)), _readPos(0), _writePos(0)
+std::size_t Message::getRemainingSize() const
 {
+	return getContent().getSize() - _readPos;
 }
 
-std::unique_ptr<Message> Message::parse(const Span<std::uint8_t>& data)
+std::vector<std::uint8_t> Message::serialize(FramingVersion version) const
 {
-	if (data.getSize() <= HeaderSize)
-		return nullptr;
+	auto content = getContent();
+	auto headerSize = getHeaderSize(version);
+
+	std::vector<std::uint8_t> result(headerSize + content.getSize());
+	writeHeader(result.data(), content.getSize(), version);
+	std::copy(content.getData(), content.getData() + content.getSize(), result.begin() + headerSize);
 
-	Message headerMessage(data.copyToVector(0, HeaderSize));
-	auto messageLength = headerMessage.read<std::uint16_t>();
-	if (messageLength > data.getSize() - HeaderSize)
-		return nullptr;
+	return result;
+}
 
-	return std::make_unique<Message>(data.copyToVector(HeaderSize, messageLength));
+void Message::detach()
+{
+	_data.assign(_view, _view + _viewSize);
+	_view = nullptr;
+	_viewSize = 0;
 }
 
-std::size_t Message::getTotalSize() const
+std::size_t Message::readSequenceHeader() const
 {
-	return HeaderSize + _data.size();
+	// Count has 7, 14 or 29 bits depending on the leading bits of the first byte
+	auto firstByte = read<std::uint8_t>();
+	if ((firstByte & 0x80) == 0)
+		return firstByte & 0x7F;
+	else if ((firstByte & 0xC0) == 0x80)
+	{
+		auto secondByte = read<std::uint8_t>();
+		return (static_cast<std::size_t>(firstByte & 0x3F) << 8) | secondByte;
+	}
+	else if ((firstByte & 0xE0) == 0xC0)
+	{
+		std::size_t count = firstByte & 0x1F;
+		for (auto i = 0; i < 3; ++i)
+			count = (count << 8) | read<std::uint8_t>();
+		return count;
+	}
+	else
+		throw SequenceTooLongError();
 }
 
-const std::vector<std::uint8_t>& Message::getContent() const
+void Message::writeSequenceHeader(std::size_t count)
 {
-	return _data;
+	if (count > 0x1FFFFFFF)
+		throw SequenceTooLongError();
+
+	writeSequenceHeader(appendBytes(getSequenceHeaderSize(count)), count);
+}
+
+void Message::writeSequenceHeader(std::uint8_t* output, std::size_t count)
+{
+	if (count <= 0x7F)
+	{
+		output[0] = count;
+	}
+	else if (count <= 0x3FFF)
+	{
+		output[0] = 0x80 | ((count >> 8) & 0x3F);
+		output[1] = count & 0xFF;
+	}
+	else if (count <= 0x1FFFFFFF)
+	{
+		output[0] = 0xC0 | ((count >> 24) & 0x1F);
+		output[1] = (count >> 16) & 0xFF;
+		output[2] = (count >> 8) & 0xFF;
+		output[3] = count & 0xFF;
+	}
+	else
+		throw SequenceTooLongError();
+}
+
+Span<std::uint8_t> Message::readBytes(std::size_t size) const
+{
+	if (getRemainingSize() < size)
+		throw NotEnoughDataError();
+
+	Span<std::uint8_t> result{getContent().getData() + _readPos, size};
+	_readPos += size;
+	return result;
+}
+
+void Message::writeBytes(const std::uint8_t* data, std::size_t size)
+{
+	std::memcpy(appendBytes(size), data, size);
+}
+
+Span<std::uint8_t> Message::readByteSequence() const
+{
+	return readBytes(readSequenceHeader());
+}
+
+std::uint8_t* Message::writeByteSequence(std::size_t size)
+{
+	reserve(getSequenceHeaderSize(size) + size);
+	writeSequenceHeader(size);
+	return appendBytes(size);
+}
+
+std::uint8_t* Message::appendBytes(std::size_t size)
+{
+	if (_view != nullptr)
+		detach();
+
+	if (_writePos + size > _data.size())
+		_data.resize(_writePos + size);
+
+	auto result = _data.data() + _writePos;
+	_writePos += size;
+	return result;
 }
 
-std::vector<std::uint8_t> Message::serialize() const
+BigInt Message::readElement(const BigInt& modulus) const
 {
-	Message headerMsg;
-	headerMsg.write<std::uint16_t>(_data.size());
+	BigInt result;
+	if (_wireFormat == WireFormatV1)
+		result = read<BigInt>();
+	else
+	{
+		auto bytes = readBytes(getElementSize(modulus));
+		result = BigInt{ bytes.getData(), bytes.getSize() };
+	}
 
-	std::vector<std::uint8_t> result(HeaderSize + _data.size());
-	std::copy(headerMsg.getContent().begin(), headerMsg.getContent().end(), result.begin());
-	std::copy(_data.begin(), _data.end(), result.begin() + HeaderSize);
+	// Elements are always written reduced (V1 may negate them), the fixed width of V2 could still carry larger values
+	if ((result.getSign() < 0 ? -result : result) >= modulus)
+		throw ElementOutOfRangeError();
 
 	return result;
 }
 
+std::vector<BigInt> Message::readElementSequence(const BigInt& modulus) const
+{
+	// Every element takes at least one byte (V1) or the width of the modulus (V2), so count from the other side cannot make us reserve more
+	auto count = readSequenceHeader();
+	auto minElementSize = _wireFormat == WireFormatV1 ? 1 : std::max<std::size_t>(getElementSize(modulus), 1);
+	if (count > getRemainingSize() / minElementSize)
+		throw NotEnoughDataError();
+
+	std::vector<BigInt> result;
+	result.reserve(count);
+	for (std::size_t i = 0; i < count; ++i)
+		result.push_back(readElement(modulus));
+
+	return result;
+}
+
+void Message::writeElementSequence(std::vector<BigInt>::const_iterator first, std::vector<BigInt>::const_iterator last, const BigInt& modulus)
+{
+	std::size_t count = std::distance(first, last);
+	std::size_t size = getSequenceHeaderSize(count);
+	for (auto itr = first; itr != last; ++itr)
+		size += getSerializedSize(GroupElement{*itr, modulus});
+
+	reserve(size);
+	writeSequenceHeader(count);
+	for (auto itr = first; itr != last; ++itr)
+		*this << GroupElement{*itr, modulus};
+}
+
 const Message& Message::operator>>(std::string& str) const
 {
-	str.clear();
+	if (_wireFormat == WireFormatV2)
+	{
+		auto bytes = readByteSequence();
+		str.assign(reinterpret_cast<const char*>(bytes.getData()), bytes.getSize());
+		return *this;
+	}
+
+	auto content = getContent();
+	auto remaining = content.getSize() - _readPos;
+	auto data = content.getData() + _readPos;
 
-	char c;
-	while ((c = read<char>()) != '\0')
-		str += c;
+	if (remaining > 0 && data[0] == LengthPrefixedStringTag)
+	{
+		++_readPos;
+		std::size_t length = read<std::uint32_t>();
+		if (content.getSize() - _readPos < length)
+			throw NotEnoughDataError();
 
+		str.assign(reinterpret_cast<const char*>(content.getData() + _readPos), length);
+		_readPos += length;
+		return *this;
+	}
+
+	// Legacy strings are terminated with '\0'
+	auto end = static_cast<const std::uint8_t*>(std::memchr(data, '\0', remaining));
+	if (end == nullptr)
+		throw NotEnoughDataError();
+
+	str.assign(reinterpret_cast<const char*>(data), end - data);
+	_readPos += end - data + 1;
 	return *this;
 }
 
 const Message& Message::operator>>(boost::dynamic_bitset<std::uint64_t>& bitset) const
 {
-	bitset = boost::dynamic_bitset<std::uint64_t>(read<std::string>());
+	if (_wireFormat == WireFormatV1)
+	{
+		bitset = boost::dynamic_bitset<std::uint64_t>(read<std::string>());
+		return *this;
+	}
+
+	// Number of bits is followed by the blocks, only as many bytes of them as needed for that many bits
+	using Block = boost::dynamic_bitset<std::uint64_t>::block_type;
+	auto bitCount = readSequenceHeader();
+	auto bytes = readBytes((bitCount + 7) / 8);
+
+	bitset.clear();
+	bitset.reserve(bitCount);
+	for (std::size_t pos = 0; pos < bytes.getSize(); pos += sizeof(Block))
+	{
+		Block block = 0;
+		std::memcpy(&block, bytes.getData() + pos, std::min(sizeof(Block), bytes.getSize() - pos));
+		bitset.append(block);
+	}
+
+	// Shrinking clears the padding bits of the last block, whatever the other side has sent in them
+	bitset.resize(bitCount);
 	return *this;
 }
 
 Message& Message::operator<<(const std::string& str)
 {
-	for (auto itr = str.begin(); itr != str.end(); ++itr)
-		write<char>(*itr);
+	if (_wireFormat == WireFormatV2)
+	{
+		writeSequenceHeader(str.size());
+		writeBytes(reinterpret_cast<const std::uint8_t*>(str.data()), str.size());
+		return *this;
+	}
+
+	// Peers without negotiation read only NUL terminated strings, which cannot carry '\0' or start with the tag
+	if (str.find('\0') == std::string::npos && (str.empty() || static_cast<std::uint8_t>(str[0]) != LengthPrefixedStringTag))
+	{
+		auto data = appendBytes(str.size() + 1);
+		std::memcpy(data, str.data(), str.size());
+		data[str.size()] = '\0';
+		return *this;
+	}
+
+	if (str.size() > std::numeric_limits<std::uint32_t>::max())
+		throw SequenceTooLongError();
 
-	write<char>('\0');
+	write<std::uint8_t>(LengthPrefixedStringTag);
+	write<std::uint32_t>(str.size());
+	writeBytes(reinterpret_cast<const std::uint8_t*>(str.data()), str.size());
 	return *this;
 }
 
 Message& Message::operator<<(const boost::dynamic_bitset<std::uint64_t>& bitset)
 {
-	std::string bitsetStr;
-	boost::to_string(bitset, bitsetStr);
-	write(bitsetStr);
+	if (_wireFormat == WireFormatV1)
+	{
+		std::string bitsetStr;
+		boost::to_string(bitset, bitsetStr);
+		write(bitsetStr);
+		return *this;
+	}
+
+	using Block = boost::dynamic_bitset<std::uint64_t>::block_type;
+	auto byteCount = (bitset.size() + 7) / 8;
+	reserve(getSequenceHeaderSize(bitset.size()) + byteCount);
+	writeSequenceHeader(bitset.size());
+
+	// Blocks are copied right into the message, the last one only partially
+	auto bytes = appendBytes(byteCount);
+	std::size_t pos = 0;
+	boost::to_block_range(bitset, boost::make_function_output_iterator(
+			[&](Block block) {
+				auto size = std::min(sizeof(Block), byteCount - pos);
+				std::memcpy(bytes + pos, &block, size);
+				pos += size;
+			}
+		));
+
+	return *this;
+}
+
+Message& Message::operator<<(const GroupElement& element)
+{
+	if (_wireFormat == WireFormatV1)
+		return *this << element.value;
+
+	// Element is reduced first, so it always fits into the width of the modulus
+	auto size = getElementSize(element.modulus);
+	if (element.value.getSign() >= 0 && element.value < element.modulus)
+		element.value.writeRawBytes(appendBytes(size), size);
+	else
+	{
+		auto reduced = element.value % element.modulus;
+		if (reduced.getSign() < 0)
+			reduced = element.modulus - (-std::move(reduced));
+
+		reduced.writeRawBytes(appendBytes(size), size);
+	}
+
 	return *this;
 }
@@ -1,7 +1,11 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <cstring>
+#include <limits>
 #include <memory>
+#include <string>
 #include <type_traits>
 #include <vector>
 
@@ -24,10 +28,56 @@ public:
 	SequenceTooLongError() noexcept : Error("Sequence is too long.") {}
 };
 
+class FrameTooLongError : public Error
+{
+public:
+	FrameTooLongError() noexcept : Error("Message is too long to be framed.") {}
+};
+
+class ElementOutOfRangeError : public Error
+{
+public:
+	ElementOutOfRangeError() noexcept : Error("Group element is not reduced modulo its modulus.") {}
+};
+
+/**
+ * Version 1 frames have 16-bit length header, version 2 frames have 32-bit one.
+ * Version is negotiated by both sides of the connection, see Service::exchangePublicKeys().
+ */
+enum FramingVersion : std::uint8_t
+{
+	FramingV1 = 1,
+	FramingV2 = 2
+};
+
+/**
+ * Encoding of values inside messages. Version 1 is the original one. Version 2 writes bitsets packed into bytes,
+ * prefixes strings and integers with variable-length sizes (same as sequence counts) and writes group elements
+ * with fixed width given by their modulus. Version is negotiated together with framing, see Service::exchangePublicKeys().
+ */
+enum WireFormat : std::uint8_t
+{
+	WireFormatV1 = 1,
+	WireFormatV2 = 2
+};
+
+/**
+ * Element of the group of integers modulo modulus. Written as plain BigInt in WireFormatV1, reduced and with the fixed
+ * width of the modulus in WireFormatV2, so it carries neither sign nor size there. Other side reads it with Message::readElement().
+ */
+struct GroupElement
+{
+	const BigInt& value;
+	const BigInt& modulus;
+};
+
 class Message
 {
 public:
-	constexpr static const std::size_t HeaderSize = sizeof(std::uint16_t);
+	constexpr static const std::size_t MaxFrameSize = 16 * 1024 * 1024;
+	// Never present in valid UTF-8, so it does not clash with the first byte of NUL terminated (legacy) strings.
+	// WireFormatV1 writes strings NUL terminated and uses the tag only for those which cannot be written that way.
+	constexpr static const std::uint8_t LengthPrefixedStringTag = 0xFF;
 
 	Message();
 	Message(const std::vector<std::uint8_t>& data);
@@ -38,25 +88,80 @@ public:
 	Message& operator=(const Message&) = default;
 	Message& operator=(Message&&) = default;
 
-	static std::unique_ptr<Message> parse(const Span<std::uint8_t>& buffer);
+	static std::size_t getHeaderSize(FramingVersion version);
+	static std::size_t getMaxPayloadSize(FramingVersion version);
+	static bool peekPayloadSize(const Span<std::uint8_t>& buffer, std::size_t& payloadSize, FramingVersion version = FramingV1);
+	static Message view(const Span<std::uint8_t>& payload);
+	static void writeHeader(std::uint8_t* output, std::size_t payloadSize, FramingVersion version = FramingV1);
+
+	template <typename T>
+	static std::enable_if_t<std::is_integral<std::decay_t<T>>::value, std::size_t> getSerializedSize(T)
+	{
+		return sizeof(T);
+	}
+
+	// Serialized sizes are upper bounds valid for any wire format, they are only used to reserve space in advance
+	static std::size_t getSerializedSize(const std::string& str);
+	static std::size_t getSerializedSize(const boost::dynamic_bitset<std::uint64_t>& bitset);
+	static std::size_t getSerializedSize(const BigInt& bigint);
+	static std::size_t getSerializedSize(const GroupElement& element);
+	static std::size_t getSequenceHeaderSize(std::size_t count);
+	static std::size_t getElementSize(const BigInt& modulus);
+
+	WireFormat getWireFormat() const { return _wireFormat; }
+	void setWireFormat(WireFormat format) { _wireFormat = format; }
+
+	void assign(const Span<std::uint8_t>& content);
+	void clear();
+	void reserve(std::size_t size);
 
-	std::size_t getTotalSize() const;
-	const std::vector<std::uint8_t>& getContent() const;
-	std::vector<std::uint8_t> serialize() const;
+	std::size_t getTotalSize(FramingVersion version = FramingV1) const;
+	Span<std::uint8_t> getContent() const;
+	std::size_t getRemainingSize() const;
+	std::vector<std::uint8_t> serialize(FramingVersion version = FramingV1) const;
 
+	// Hash is calculated over version 2 frame, so it is the same for messages of any size. Only peers without
+	// negotiation hash the version 1 frame they have sent, see Service::isLegacyPeer().
 	template <HashAlgo Algo>
-	BigInt getHash() const
+	BigInt getHash(FramingVersion version = FramingV2) const
 	{
-		return hash<Algo>(serialize());
+		auto content = getContent();
+
+		std::array<std::uint8_t, sizeof(std::uint32_t)> header;
+		writeHeader(header.data(), content.getSize(), version);
+
+		HashContext<Algo> context;
+		context.update({header.data(), getHeaderSize(version)});
+		context.update(content);
+		return context.final();
+	}
+
+	// Same as getHash() of every message, but all of them are hashed together
+	template <HashAlgo Algo>
+	static std::vector<BigInt> getHashes(const std::vector<const Message*>& messages, FramingVersion version = FramingV2)
+	{
+		std::vector<std::array<std::uint8_t, sizeof(std::uint32_t)>> headers(messages.size());
+		std::vector<HashPieces> inputs;
+		inputs.reserve(messages.size());
+		for (std::size_t i = 0; i < messages.size(); ++i)
+		{
+			auto content = messages[i]->getContent();
+			writeHeader(headers[i].data(), content.getSize(), version);
+			inputs.push_back({{headers[i].data(), getHeaderSize(version)}, content});
+		}
+
+		return hashBatch<Algo>(inputs);
 	}
 
 	template <typename T>
 	std::enable_if_t<std::is_integral<std::decay_t<T>>::value, T> read() const
 	{
-		if (_data.size() - _readPos < sizeof(T))
+		auto content = getContent();
+		if (content.getSize() - _readPos < sizeof(T))
 			throw NotEnoughDataError();
 
-		T result = *reinterpret_cast<const T*>(_data.data() + _readPos);
+		T result;
+		std::memcpy(&result, content.getData() + _readPos, sizeof(T));
 		_readPos += sizeof(T);
 		return result;
 	}
@@ -78,6 +183,9 @@ public:
 	template <typename T>
 	std::enable_if_t<std::is_integral<std::decay_t<T>>::value> write(T value)
 	{
+		if (_view != nullptr)
+			detach();
+
 		if (_writePos + sizeof(T) > _data.size())
 			_data.resize(_writePos + sizeof(T));
 
@@ -92,26 +200,29 @@ public:
 	}
 
 	template <typename T>
-	std::vector<T> readSequence() const
+	std::enable_if_t<std::is_integral<T>::value, std::vector<T>> readSequence() const
 	{
-		std::size_t count = 0;
+		auto count = readSequenceHeader();
 
-		auto firstByte = read<std::uint8_t>();
-		if ((firstByte & 0x80) == 0)
-		{
-			count = firstByte & 0x7F;
-		}
-		else if ((firstByte & 0xC0) == 0x80)
-		{
-			auto secondByte = read<std::uint8_t>();
-			count =
-				(static_cast<std::size_t>(firstByte & 0x3F) << 8) |
-				secondByte;
-		}
-		else
-			throw SequenceTooLongError();
+		// Integral elements are stored as they are, so the whole sequence is copied at once
+		auto content = getContent();
+		if (content.getSize() - _readPos < count * sizeof(T))
+			throw NotEnoughDataError();
+
+		std::vector<T> result(count);
+		std::memcpy(result.data(), content.getData() + _readPos, count * sizeof(T));
+		_readPos += count * sizeof(T);
+		return result;
+	}
 
+	template <typename T>
+	std::enable_if_t<!std::is_integral<T>::value, std::vector<T>> readSequence() const
+	{
+		auto count = readSequenceHeader();
+
+		// Every element takes at least one byte, so count from the other side cannot make us reserve more than that
 		std::vector<T> result;
+		result.reserve(std::min(count, getContent().getSize() - _readPos));
 		for (std::size_t i = 0; i < count; ++i)
 			result.push_back(read<T>());
 
@@ -119,33 +230,62 @@ public:
 	}
 
 	template <typename T>
-	void writeSequence(typename std::vector<T>::const_iterator first, typename std::vector<T>::const_iterator last)
+	std::enable_if_t<std::is_integral<T>::value> writeSequence(typename std::vector<T>::const_iterator first, typename std::vector<T>::const_iterator last)
 	{
 		std::size_t count = std::distance(first, last);
-		if (count <= 0x7F)
-		{
-			write<std::uint8_t>(count);
-		}
-		else if (count <= 0x3FFF)
-		{
-			write<std::uint8_t>(0x80 | ((count >> 8) & 0x3F));
-			write<std::uint8_t>(count & 0xFF);
-		}
-		else
-			throw SequenceTooLongError();
+		reserve(getSequenceHeaderSize(count) + count * sizeof(T));
+		writeSequenceHeader(count);
+
+		if (count > 0)
+			writeBytes(reinterpret_cast<const std::uint8_t*>(&*first), count * sizeof(T));
+	}
 
+	template <typename T>
+	std::enable_if_t<!std::is_integral<T>::value> writeSequence(typename std::vector<T>::const_iterator first, typename std::vector<T>::const_iterator last)
+	{
+		std::size_t count = std::distance(first, last);
+		std::size_t size = getSequenceHeaderSize(count);
 		for (auto itr = first; itr != last; ++itr)
-			write<T>(*itr);
+			size += getSerializedSize(*itr);
+
+		reserve(size);
+		writeSequenceHeader(count);
+		for (auto itr = first; itr != last; ++itr)
+			write(static_cast<const T&>(*itr));
 	}
 
+	Span<std::uint8_t> readBytes(std::size_t size) const;
+	void writeBytes(const std::uint8_t* data, std::size_t size);
+	std::uint8_t* appendBytes(std::size_t size); // returns storage for size bytes, which the caller fills in
+
+	// Same encoding as readSequence/writeSequence of bytes, but the bytes are accessed right in the message storage
+	Span<std::uint8_t> readByteSequence() const;
+	std::uint8_t* writeByteSequence(std::size_t size);
+
+	// Variable-length count, 1, 2 or 4 bytes long
+	std::size_t readSequenceHeader() const;
+	void writeSequenceHeader(std::size_t count);
+	static void writeSequenceHeader(std::uint8_t* output, std::size_t count); // output has getSequenceHeaderSize(count) bytes
+
+	// Both throw ElementOutOfRangeError if absolute value of any element is not less than modulus
+	BigInt readElement(const BigInt& modulus) const;
+	std::vector<BigInt> readElementSequence(const BigInt& modulus) const;
+	void writeElementSequence(std::vector<BigInt>::const_iterator first, std::vector<BigInt>::const_iterator last, const BigInt& modulus);
+
 	const Message& operator>>(std::string& str) const;
 	const Message& operator>>(boost::dynamic_bitset<std::uint64_t>& bitset) const;
 
 	Message& operator<<(const std::string& str);
 	Message& operator<<(const boost::dynamic_bitset<std::uint64_t>& bitset);
+	Message& operator<<(const GroupElement& element);
 
 private:
+	void detach();
+
 	std::vector<std::uint8_t> _data;
+	const std::uint8_t* _view; // content is not owned if set
+	std::size_t _viewSize;
 	mutable std::size_t _readPos;
 	std::size_t _writePos;
+	WireFormat _wireFormat;
 };
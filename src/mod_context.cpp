@@ -0,0 +1,274 @@
+#include <algorithm>
+
+#include "mod_context.h"
+#include "parallel.h"
+
+namespace {
+
+const std::size_t PowWindowBits = 4;
+const std::size_t MinParallelInversions = 64;
+const std::size_t MinParallelFactors = 64;
+
+// Double-width product buffer reused by all contexts on the same thread
+mp_limb_t* productBuffer(mp_size_t limbCount)
+{
+	thread_local std::vector<mp_limb_t> buffer;
+	buffer.assign(2 * limbCount, 0);
+	return buffer.data();
+}
+
+}
+
+ModContext::ModContext(const BigInt& modulus) : _modulus(modulus), _montgomeryOne(), _montgomerySquare(),
+	_limbCount(mpz_size(modulus._impl.get_mpz_t())), _modulusInverse()
+{
+	if (mpz_even_p(_modulus._impl.get_mpz_t()))
+		throw EvenModulusError();
+
+	// Newton iteration doubles the number of correct low bits in every step
+	auto lowLimb = mpz_getlimbn(_modulus._impl.get_mpz_t(), 0);
+	mp_limb_t inverse = lowLimb;
+	for (std::size_t correctBits = 3; correctBits < GMP_NUMB_BITS; correctBits *= 2)
+		inverse *= 2 - lowLimb * inverse;
+	_modulusInverse = -inverse;
+
+	mpz_setbit(_montgomeryOne._impl.get_mpz_t(), _limbCount * GMP_NUMB_BITS);
+	_montgomeryOne._impl %= _modulus._impl;
+
+	mpz_setbit(_montgomerySquare._impl.get_mpz_t(), 2 * _limbCount * GMP_NUMB_BITS);
+	_montgomerySquare._impl %= _modulus._impl;
+}
+
+const BigInt& ModContext::getModulus() const
+{
+	return _modulus;
+}
+
+BigInt ModContext::toMontgomery(const BigInt& value) const
+{
+	BigInt result;
+	toMontgomery(value, result);
+	return result;
+}
+
+BigInt ModContext::fromMontgomery(const BigInt& value) const
+{
+	BigInt result;
+	fromMontgomery(value, result);
+	return result;
+}
+
+BigInt ModContext::mulMod(const BigInt& lhs, const BigInt& rhs) const
+{
+	BigInt result;
+	multiply(lhs, rhs, result);
+	return result;
+}
+
+BigInt ModContext::sqrMod(const BigInt& value) const
+{
+	BigInt result;
+	multiply(value, value, result);
+	return result;
+}
+
+void ModContext::toMontgomery(const BigInt& value, BigInt& result) const
+{
+	multiply(value, _montgomerySquare, result);
+}
+
+void ModContext::fromMontgomery(const BigInt& value, BigInt& result) const
+{
+	// Wider value would not fit into the product buffer
+	if (!isReduced(value))
+	{
+		BigInt reduced;
+		mpz_mod(reduced._impl.get_mpz_t(), value._impl.get_mpz_t(), _modulus._impl.get_mpz_t());
+		fromMontgomery(reduced, result);
+		return;
+	}
+
+	auto product = productBuffer(_limbCount);
+	auto valueLimbs = mpz_limbs_read(value._impl.get_mpz_t());
+	std::copy(valueLimbs, valueLimbs + mpz_size(value._impl.get_mpz_t()), product);
+
+	reduce(product, result);
+}
+
+void ModContext::mulMod(const BigInt& lhs, const BigInt& rhs, BigInt& result) const
+{
+	multiply(lhs, rhs, result);
+}
+
+void ModContext::sqrMod(const BigInt& value, BigInt& result) const
+{
+	multiply(value, value, result);
+}
+
+BigInt ModContext::powMod(const BigInt& base, const BigInt& power) const
+{
+	// Fixed window exponentiation with table of base^0 .. base^(2^w - 1)
+	std::vector<BigInt> table(std::size_t{1} << PowWindowBits);
+	table[0] = _montgomeryOne;
+	for (std::size_t i = 1; i < table.size(); ++i)
+		multiply(table[i - 1], base, table[i]);
+
+	auto exp = power._impl.get_mpz_t();
+	auto windowCount = (power.getNumberOfBits() + PowWindowBits - 1) / PowWindowBits;
+
+	BigInt result = _montgomeryOne, temp;
+	for (std::size_t window = windowCount; window-- > 0;)
+	{
+		for (std::size_t i = 0; i < PowWindowBits; ++i)
+		{
+			multiply(result, result, temp);
+			std::swap(result, temp);
+		}
+
+		std::size_t digit = 0;
+		for (std::size_t i = PowWindowBits; i-- > 0;)
+			digit = (digit << 1) | mpz_tstbit(exp, window * PowWindowBits + i);
+
+		if (digit != 0)
+		{
+			multiply(result, table[digit], temp);
+			std::swap(result, temp);
+		}
+	}
+
+	return result;
+}
+
+BigInt ModContext::invertMod(const BigInt& value) const
+{
+	BigInt result;
+	fromMontgomery(value, result);
+	if (mpz_invert(result._impl.get_mpz_t(), result._impl.get_mpz_t(), _modulus._impl.get_mpz_t()) == 0)
+		throw NotInvertibleError();
+
+	toMontgomery(result, result);
+	return result;
+}
+
+void ModContext::invertModBatch(std::vector<BigInt>& values) const
+{
+	parallelFor(values.size(), MinParallelInversions,
+			[&, this](std::size_t, std::size_t begin, std::size_t end) {
+				if (begin == end)
+					return;
+
+				// Prefix products of the chunk, the inverse of the last one yields inverses of all values
+				std::vector<BigInt> prefixes(end - begin);
+				prefixes[0] = values[begin];
+				for (std::size_t i = 1; i < prefixes.size(); ++i)
+					multiply(prefixes[i - 1], values[begin + i], prefixes[i]);
+
+				auto inverse = invertMod(prefixes.back());
+				BigInt valueInverse;
+				for (std::size_t i = prefixes.size() - 1; i > 0; --i)
+				{
+					multiply(inverse, prefixes[i - 1], valueInverse);
+					multiply(inverse, values[begin + i], inverse);
+					std::swap(values[begin + i], valueInverse);
+				}
+				std::swap(values[begin], inverse);
+			});
+}
+
+void ModContext::productMod(const std::vector<const BigInt*>& factors, BigInt& result) const
+{
+	auto multiplyChunk = [&, this](std::size_t begin, std::size_t end, BigInt& product) {
+		product = begin < end ? *factors[begin] : _montgomeryOne;
+		for (std::size_t i = begin + 1; i < end; ++i)
+			multiply(product, *factors[i], product);
+	};
+
+	// Single chunk is multiplied right into the result, so the product does not allocate once result is large enough
+	auto chunkCount = getParallelChunkCount(factors.size(), MinParallelFactors);
+	if (chunkCount == 1)
+	{
+		multiplyChunk(0, factors.size(), result);
+		return;
+	}
+
+	// Every chunk is a leaf of the product tree
+	std::vector<BigInt> level(chunkCount);
+	parallelFor(factors.size(), MinParallelFactors,
+			[&](std::size_t chunk, std::size_t begin, std::size_t end) { multiplyChunk(begin, end, level[chunk]); });
+
+	while (level.size() > 1)
+	{
+		std::vector<BigInt> nextLevel((level.size() + 1) / 2);
+		parallelFor(level.size() / 2, 1,
+				[&, this](std::size_t, std::size_t begin, std::size_t end) {
+					for (std::size_t i = begin; i < end; ++i)
+						multiply(level[2 * i], level[2 * i + 1], nextLevel[i]);
+				});
+
+		if (level.size() % 2 != 0)
+			nextLevel.back() = std::move(level.back());
+
+		level = std::move(nextLevel);
+	}
+
+	result = std::move(level.front());
+}
+
+void ModContext::reduce(mp_limb_t* product, BigInt& result) const
+{
+	auto modulus = mpz_limbs_read(_modulus._impl.get_mpz_t());
+
+	// Word-by-word Montgomery reduction, the carry of every step is stored in the limb it has just zeroed
+	auto low = product;
+	for (mp_size_t i = 0; i < _limbCount; ++i)
+	{
+		auto quotient = low[0] * _modulusInverse;
+		low[0] = mpn_addmul_1(low, modulus, _limbCount, quotient);
+		++low;
+	}
+
+	auto resultLimbs = mpz_limbs_write(result._impl.get_mpz_t(), _limbCount);
+	auto carry = mpn_add_n(resultLimbs, product + _limbCount, product, _limbCount);
+	if (carry != 0 || mpn_cmp(resultLimbs, modulus, _limbCount) >= 0)
+		mpn_sub_n(resultLimbs, resultLimbs, modulus, _limbCount);
+
+	mpz_limbs_finish(result._impl.get_mpz_t(), _limbCount);
+}
+
+bool ModContext::isReduced(const BigInt& value) const
+{
+	return value.getSign() >= 0 && value < _modulus;
+}
+
+void ModContext::multiply(const BigInt& lhs, const BigInt& rhs, BigInt& result) const
+{
+	// Wider operands would not fit into the product buffer and the reduction needs the product below N * R
+	if (!isReduced(lhs) || !isReduced(rhs))
+	{
+		BigInt lhsReduced, rhsReduced;
+		mpz_mod(lhsReduced._impl.get_mpz_t(), lhs._impl.get_mpz_t(), _modulus._impl.get_mpz_t());
+		mpz_mod(rhsReduced._impl.get_mpz_t(), rhs._impl.get_mpz_t(), _modulus._impl.get_mpz_t());
+		multiply(lhsReduced, rhsReduced, result);
+		return;
+	}
+
+	auto lhsSize = static_cast<mp_size_t>(mpz_size(lhs._impl.get_mpz_t()));
+	auto rhsSize = static_cast<mp_size_t>(mpz_size(rhs._impl.get_mpz_t()));
+	if (lhsSize == 0 || rhsSize == 0)
+	{
+		result._impl = 0;
+		return;
+	}
+
+	auto product = productBuffer(_limbCount);
+	auto lhsLimbs = mpz_limbs_read(lhs._impl.get_mpz_t());
+	auto rhsLimbs = mpz_limbs_read(rhs._impl.get_mpz_t());
+	if (lhsLimbs == rhsLimbs && lhsSize == rhsSize)
+		mpn_sqr(product, lhsLimbs, lhsSize);
+	else if (lhsSize >= rhsSize)
+		mpn_mul(product, lhsLimbs, lhsSize, rhsLimbs, rhsSize);
+	else
+		mpn_mul(product, rhsLimbs, rhsSize, lhsLimbs, lhsSize);
+
+	reduce(product, result);
+}
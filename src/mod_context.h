@@ -0,0 +1,72 @@
+#pragma once
+
+#include <vector>
+
+#include <gmp.h>
+
+#include "big_int.h"
+#include "error.h"
+
+class EvenModulusError : public Error
+{
+public:
+	EvenModulusError() noexcept : Error("Montgomery arithmetic requires odd modulus.") {}
+};
+
+class NotInvertibleError : public Error
+{
+public:
+	NotInvertibleError() noexcept : Error("Value is not invertible modulo N.") {}
+};
+
+/**
+ * Modular arithmetic context for a fixed odd modulus N.
+ *
+ * Values are kept in Montgomery form (a * R mod N, where R = 2^(limb bits * limb count of N)),
+ * so every multiplication is reduced with a Montgomery reduction instead of a full division.
+ * All operations except conversions take and return values in Montgomery form. Operands which are
+ * negative or not less than N are reduced first, which costs a division and an allocation.
+ */
+class ModContext
+{
+public:
+	ModContext(const BigInt& modulus);
+	ModContext(const ModContext&) = default;
+	ModContext(ModContext&&) = default;
+
+	ModContext& operator=(const ModContext&) = default;
+	ModContext& operator=(ModContext&&) = default;
+
+	const BigInt& getModulus() const;
+
+	BigInt toMontgomery(const BigInt& value) const;
+	BigInt fromMontgomery(const BigInt& value) const;
+
+	BigInt mulMod(const BigInt& lhs, const BigInt& rhs) const;
+	BigInt sqrMod(const BigInt& value) const;
+
+	// Variants storing into result, which may be one of the operands, so they do not allocate once result is large enough
+	void toMontgomery(const BigInt& value, BigInt& result) const;
+	void fromMontgomery(const BigInt& value, BigInt& result) const;
+	void mulMod(const BigInt& lhs, const BigInt& rhs, BigInt& result) const;
+	void sqrMod(const BigInt& value, BigInt& result) const;
+
+	BigInt powMod(const BigInt& base, const BigInt& power) const;
+	BigInt invertMod(const BigInt& value) const;
+
+	// Inverts all values in place with a single inversion per thread (Montgomery's trick)
+	void invertModBatch(std::vector<BigInt>& values) const;
+	// Product of all factors, chunks of them are multiplied in parallel and then combined by a product tree. Result must not be one of the factors.
+	void productMod(const std::vector<const BigInt*>& factors, BigInt& result) const;
+
+private:
+	bool isReduced(const BigInt& value) const;
+	void reduce(mp_limb_t* product, BigInt& result) const;
+	void multiply(const BigInt& lhs, const BigInt& rhs, BigInt& result) const;
+
+	BigInt _modulus;
+	BigInt _montgomeryOne; // R mod N
+	BigInt _montgomerySquare; // R^2 mod N
+	mp_size_t _limbCount;
+	mp_limb_t _modulusInverse; // -N^-1 mod 2^(limb bits)
+};
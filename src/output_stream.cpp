@@ -0,0 +1,53 @@
+#include "output_stream.h"
+#include "service.h"
+
+OutputStream::OutputStream(Service& service, std::size_t chunkSize) : _service(service), _chunkData(), _chunkSize(std::max<std::size_t>(chunkSize, 1)),
+	_chunk(), _chunkIndex(0), _totalSize(0), _finished(false)
+{
+	_chunkData.reserve(_chunkSize);
+}
+
+void OutputStream::write(const Span<std::uint8_t>& data)
+{
+	if (_finished)
+		throw StreamFinishedError();
+
+	auto pos = data.getData();
+	auto remaining = data.getSize();
+	while (remaining > 0)
+	{
+		// Full chunk is sent only once there is more data, so the last one can always be marked as final
+		if (_chunkData.size() == _chunkSize)
+			sendChunk(DataChunk);
+
+		auto size = std::min(remaining, _chunkSize - _chunkData.size());
+		_chunkData.insert(_chunkData.end(), pos, pos + size);
+		_totalSize += size;
+		pos += size;
+		remaining -= size;
+	}
+}
+
+void OutputStream::finish()
+{
+	if (_finished)
+		throw StreamFinishedError();
+
+	sendChunk(FinalChunk);
+	_service.flush();
+	_finished = true;
+}
+
+void OutputStream::sendChunk(ChunkType type)
+{
+	_chunk.reserve(sizeof(std::uint8_t) + sizeof(std::uint64_t) + _chunkData.size());
+	_chunk.write<std::uint8_t>(type);
+	_chunk.write<std::uint64_t>(_chunkIndex++);
+	_chunk.writeBytes(_chunkData.data(), _chunkData.size());
+	_service.sendMessage(_chunk);
+
+	// Both buffers keep their capacity, so they are allocated only once for the whole stream
+	std::fill(_chunkData.begin(), _chunkData.end(), 0);
+	_chunkData.clear();
+	_chunk.clear();
+}
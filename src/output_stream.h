@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "error.h"
+#include "message.h"
+#include "span.h"
+
+class Service;
+
+class StreamOrderError : public Error
+{
+public:
+	StreamOrderError() noexcept : Error("Stream chunk received out of order.") {}
+};
+
+class StreamFinishedError : public Error
+{
+public:
+	StreamFinishedError() noexcept : Error("Stream is already finished.") {}
+};
+
+/**
+ * Sends data of arbitrary size over the service in chunks of fixed size, so neither side
+ * ever holds more than a single chunk of it.
+ *
+ * Every chunk is a separate message consisting of chunk type, chunk index and data. Chunk index
+ * is checked by the receiving side (see Service::receiveStream()), so missing, repeated or reordered
+ * chunks are detected even without AEAD cipher. Last chunk is marked, so truncated stream is detected too.
+ * Stream has to be finished with finish(), otherwise the other side keeps waiting for the rest of it.
+ */
+class OutputStream
+{
+public:
+	enum ChunkType : std::uint8_t
+	{
+		DataChunk,
+		FinalChunk
+	};
+
+	constexpr static const std::size_t DefaultChunkSize = 16 * 1024;
+
+	OutputStream(Service& service, std::size_t chunkSize = DefaultChunkSize);
+	OutputStream(const OutputStream&) = delete;
+	OutputStream(OutputStream&&) = default;
+
+	OutputStream& operator=(const OutputStream&) = delete;
+
+	void write(const Span<std::uint8_t>& data);
+	void finish();
+
+	std::uint64_t getTotalSize() const { return _totalSize; }
+
+private:
+	void sendChunk(ChunkType type);
+
+	Service& _service;
+	std::vector<std::uint8_t> _chunkData;
+	std::size_t _chunkSize;
+	Message _chunk;
+	std::uint64_t _chunkIndex;
+	std::uint64_t _totalSize;
+	bool _finished;
+};
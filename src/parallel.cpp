@@ -0,0 +1,88 @@
+#include "parallel.h"
+
+namespace {
+
+// Chunks submitted from a worker are never waited for by another worker, so workers cannot deadlock each other
+thread_local bool isWorker = false;
+
+}
+
+ParallelPool& ParallelPool::getInstance()
+{
+	static ParallelPool instance(std::max<std::size_t>(std::thread::hardware_concurrency(), 1));
+	return instance;
+}
+
+ParallelPool::ParallelPool(std::size_t threadCount) : _tasks(), _mutex(), _notEmpty(), _stopping(false), _workers()
+{
+	startWorkers(threadCount);
+}
+
+ParallelPool::~ParallelPool()
+{
+	stopWorkers();
+}
+
+std::size_t ParallelPool::getThreadCount() const
+{
+	return isWorker ? 1 : _workers.size() + 1;
+}
+
+void ParallelPool::setThreadCount(std::size_t threadCount)
+{
+	stopWorkers();
+	startWorkers(threadCount);
+}
+
+std::future<void> ParallelPool::submit(std::packaged_task<void()>&& task)
+{
+	auto result = task.get_future();
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_tasks.push_back(std::move(task));
+	}
+
+	_notEmpty.notify_one();
+	return result;
+}
+
+void ParallelPool::startWorkers(std::size_t threadCount)
+{
+	_stopping = false;
+	for (std::size_t i = 1; i < threadCount; ++i)
+		_workers.emplace_back(&ParallelPool::work, this);
+}
+
+void ParallelPool::stopWorkers()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stopping = true;
+	}
+
+	_notEmpty.notify_all();
+	for (auto& worker : _workers)
+		worker.join();
+
+	_workers.clear();
+}
+
+void ParallelPool::work()
+{
+	isWorker = true;
+
+	std::unique_lock<std::mutex> lock(_mutex);
+	while (true)
+	{
+		_notEmpty.wait(lock, [this]() { return _stopping || !_tasks.empty(); });
+		if (_tasks.empty())
+			return;
+
+		auto task = std::move(_tasks.front());
+		_tasks.pop_front();
+
+		lock.unlock();
+		task(); // exception is stored in the future of the task
+		lock.lock();
+	}
+}
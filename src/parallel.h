@@ -0,0 +1,100 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Worker threads shared by all parallelFor() calls, one less than there are hardware threads, because
+ * every caller processes a chunk itself. Callers running at the same time (e.g. sessions served by
+ * SessionServer workers) queue their chunks here instead of every call starting threads of its own.
+ */
+class ParallelPool
+{
+public:
+	static ParallelPool& getInstance();
+
+	ParallelPool(std::size_t threadCount);
+	ParallelPool(const ParallelPool&) = delete;
+	~ParallelPool();
+
+	ParallelPool& operator=(const ParallelPool&) = delete;
+
+	// Threads available to a single parallelFor(), including the calling one, it is 1 on the workers themselves
+	std::size_t getThreadCount() const;
+	// Replaces the workers, so it must not be called while any parallelFor() is running
+	void setThreadCount(std::size_t threadCount);
+
+	std::future<void> submit(std::packaged_task<void()>&& task);
+
+private:
+	void startWorkers(std::size_t threadCount);
+	void stopWorkers();
+	void work();
+
+	std::deque<std::packaged_task<void()>> _tasks;
+	std::mutex _mutex;
+	std::condition_variable _notEmpty;
+	bool _stopping;
+	std::vector<std::thread> _workers;
+};
+
+/**
+ * Number of chunks parallelFor() splits count elements into. Every chunk has at least minChunkSize elements
+ * (except when there are fewer elements in total) and there is at most one chunk per thread of ParallelPool.
+ */
+inline std::size_t getParallelChunkCount(std::size_t count, std::size_t minChunkSize)
+{
+	auto threadCount = ParallelPool::getInstance().getThreadCount();
+	auto chunkCount = count / std::max<std::size_t>(minChunkSize, 1);
+	return std::max<std::size_t>(std::min(chunkCount, threadCount), 1);
+}
+
+/**
+ * Calls fn(chunk, begin, end) for contiguous chunks covering [0, count), the chunks are processed by
+ * ParallelPool workers. The first chunk is processed by the calling thread. Exception thrown by any
+ * of the chunks is rethrown once all of them are finished.
+ */
+template <typename Fn>
+void parallelFor(std::size_t count, std::size_t minChunkSize, Fn&& fn)
+{
+	auto chunkCount = getParallelChunkCount(count, minChunkSize);
+	auto chunkBounds = [&](std::size_t chunk) { return count * chunk / chunkCount; };
+
+	std::vector<std::future<void>> tasks;
+	tasks.reserve(chunkCount - 1);
+	for (std::size_t chunk = 1; chunk < chunkCount; ++chunk)
+		tasks.push_back(ParallelPool::getInstance().submit(std::packaged_task<void()>([&fn, chunk, begin = chunkBounds(chunk), end = chunkBounds(chunk + 1)]() { fn(chunk, begin, end); })));
+
+	std::exception_ptr error;
+	try
+	{
+		fn(std::size_t{0}, std::size_t{0}, chunkBounds(1));
+	}
+	catch(...)
+	{
+		error = std::current_exception();
+	}
+
+	for (auto& task : tasks)
+	{
+		try
+		{
+			task.get();
+		}
+		catch(...)
+		{
+			if (!error)
+				error = std::current_exception();
+		}
+	}
+
+	if (error)
+		std::rethrow_exception(error);
+}
@@ -0,0 +1,83 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <sys/random.h>
+
+#include <openssl/crypto.h>
+
+#include "random_pool.h"
+
+RandomPool& RandomPool::getThreadInstance()
+{
+	thread_local RandomPool instance;
+	return instance;
+}
+
+RandomPool::RandomPool() : _impl(EVP_CIPHER_CTX_new(), &EVP_CIPHER_CTX_free), _buffer(), _readPos(BufferSize), _generatedSinceReseed(0)
+{
+	reseed();
+}
+
+RandomPool::~RandomPool()
+{
+	OPENSSL_cleanse(_buffer.data(), _buffer.size());
+}
+
+void RandomPool::generate(std::uint8_t* output, std::size_t size)
+{
+	while (size > 0)
+	{
+		if (_readPos == BufferSize)
+			refill();
+
+		// Served bytes are wiped right away, so they never stay in the pool after being handed out
+		auto count = std::min(size, BufferSize - _readPos);
+		std::memcpy(output, _buffer.data() + _readPos, count);
+		OPENSSL_cleanse(_buffer.data() + _readPos, count);
+
+		_readPos += count;
+		output += count;
+		size -= count;
+	}
+}
+
+void RandomPool::reseed()
+{
+	std::array<std::uint8_t, KeySize + IVSize> seed;
+	for (std::size_t filled = 0; filled < seed.size(); )
+	{
+		auto result = getrandom(seed.data() + filled, seed.size() - filled, 0);
+		if (result < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			throw RandomSourceError();
+		}
+
+		filled += result;
+	}
+
+	EVP_EncryptInit_ex(_impl.get(), EVP_aes_256_ctr(), nullptr, seed.data(), seed.data() + KeySize);
+	OPENSSL_cleanse(seed.data(), seed.size());
+
+	_generatedSinceReseed = 0;
+}
+
+void RandomPool::refill()
+{
+	if (_generatedSinceReseed >= ReseedInterval)
+		reseed();
+
+	// Buffer is all zeroes at this point, so encrypting it in place yields the raw keystream
+	int bytesWritten = 0;
+	EVP_EncryptUpdate(_impl.get(), _buffer.data(), &bytesWritten, _buffer.data(), _buffer.size());
+
+	// Fast key erasure, the beginning of the keystream becomes the next key and is never handed out
+	EVP_EncryptInit_ex(_impl.get(), nullptr, nullptr, _buffer.data(), nullptr);
+	OPENSSL_cleanse(_buffer.data(), KeySize);
+
+	_readPos = KeySize;
+	_generatedSinceReseed += BufferSize - KeySize;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+
+#include <openssl/evp.h>
+
+#include "error.h"
+
+class RandomSourceError : public Error
+{
+public:
+	RandomSourceError() noexcept : Error("Unable to obtain seed from the operating system.") {}
+};
+
+/**
+ * Cryptographically secure generator of random bytes, one instance per thread.
+ *
+ * Bytes are produced by AES-256-CTR keystream into a buffer, so most requests are served by a plain copy
+ * without any locking. Whenever the buffer is refilled, the key is replaced by the first bytes of the new
+ * keystream, so previously generated bytes cannot be reconstructed from the state. The key is reseeded
+ * from the operating system after every ReseedInterval generated bytes.
+ */
+class RandomPool
+{
+public:
+	constexpr static const std::size_t BufferSize = 4096;
+	constexpr static const std::uint64_t ReseedInterval = 1024 * 1024;
+
+	static RandomPool& getThreadInstance();
+
+	RandomPool();
+	RandomPool(const RandomPool&) = delete;
+	~RandomPool();
+
+	RandomPool& operator=(const RandomPool&) = delete;
+
+	void generate(std::uint8_t* output, std::size_t size);
+
+	template <typename T>
+	std::enable_if_t<std::is_integral<T>::value, T> generate()
+	{
+		T result;
+		generate(reinterpret_cast<std::uint8_t*>(&result), sizeof(T));
+		return result;
+	}
+
+private:
+	constexpr static const std::size_t KeySize = 32;
+	constexpr static const std::size_t IVSize = 16;
+
+	void reseed();
+	void refill();
+
+	std::unique_ptr<EVP_CIPHER_CTX, decltype(&EVP_CIPHER_CTX_free)> _impl;
+	std::array<std::uint8_t, BufferSize> _buffer;
+	std::size_t _readPos;
+	std::uint64_t _generatedSinceReseed;
+};
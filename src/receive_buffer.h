@@ -0,0 +1,65 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "span.h"
+
+/**
+ * Growable buffer for received data. Data are consumed from the front and appended at the back.
+ * Unconsumed data are moved to the front only when there is not enough free space at the back,
+ * so every byte is moved at most once per read instead of once per parsed message.
+ */
+class ReceiveBuffer
+{
+public:
+	ReceiveBuffer(std::size_t capacity) : _buffer(capacity), _readPos(0), _writePos(0) {}
+	ReceiveBuffer(const ReceiveBuffer&) = delete;
+
+	ReceiveBuffer& operator=(const ReceiveBuffer&) = delete;
+
+	Span<std::uint8_t> getData() const { return { _buffer.data() + _readPos, _writePos - _readPos }; }
+	std::uint8_t* getWritableData() { return _buffer.data() + _readPos; }
+	std::size_t getSize() const { return _writePos - _readPos; }
+	std::size_t getCapacity() const { return _buffer.size(); }
+
+	std::uint8_t* getFreeData() { return _buffer.data() + _writePos; }
+	std::size_t getFreeSize() const { return _buffer.size() - _writePos; }
+
+	void prepare(std::size_t freeSize)
+	{
+		if (getFreeSize() >= freeSize)
+			return;
+
+		// Move unconsumed data to the front and grow only if that is still not enough
+		auto size = getSize();
+		std::memmove(_buffer.data(), _buffer.data() + _readPos, size);
+		std::memset(_buffer.data() + size, 0, _writePos - size);
+		_readPos = 0;
+		_writePos = size;
+
+		if (getFreeSize() < freeSize)
+			_buffer.resize(std::max(size + freeSize, 2 * _buffer.size()));
+	}
+
+	void commit(std::size_t size)
+	{
+		_writePos += size;
+	}
+
+	void consume(std::size_t size)
+	{
+		std::memset(_buffer.data() + _readPos, 0, size); // nullify consumed data (this is just for security reasons)
+		_readPos += size;
+
+		if (_readPos == _writePos)
+			_readPos = _writePos = 0;
+	}
+
+private:
+	std::vector<std::uint8_t> _buffer;
+	std::size_t _readPos;
+	std::size_t _writePos;
+};
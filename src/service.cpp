@@ -1,3 +1,4 @@
+#include <poll.h>
 #include <unistd.h>
 
 #include "service.h"
@@ -6,29 +7,71 @@
 namespace {
 
 const std::size_t DefaultBufferSize = 4096;
+const std::size_t MaxFreeMessages = 16;
+// Accept fails right away while the process is out of descriptors, so it is not retried in a busy loop
+const auto AcceptRetryDelay = std::chrono::milliseconds(100);
 
+// Identifies peers which negotiate the protocol, the last byte is the revision of the offer layout
+const std::array<std::uint8_t, 4> ProtocolMagic = { 'K', 'R', 'Y', 1 };
+
+// Peers without negotiation read sequences with at most 2-byte count
+const std::size_t LegacyMaxSequenceSize = 0x3FFF;
+const std::size_t LegacyIVSize = CipherEngine<Service::LegacyCipher>::TransmittedIVSize;
+
+// Values of the evidence hot loops kept per thread between rounds, so they do not allocate once they are large enough
+struct EvidenceScratch
+{
+	std::vector<const BigInt*> factors;
+	BigInt product;
+	BigInt evidence;
+	BigInt witness;
+};
+
+thread_local EvidenceScratch evidenceScratch;
+
+}
+
+Service::Service(const std::string& socketPath) : Service(std::make_shared<boost::asio::io_service>(), socketPath)
+{
+}
+
+Service::Service(const std::shared_ptr<boost::asio::io_service>& ioService, const boost::asio::local::stream_protocol::endpoint& endpoint)
+	: _ioService(ioService), _localEndpoint(endpoint), _socket(*_ioService),
+	_recvBuffer(DefaultBufferSize), _messageQueue(), _freeMessages(), _sendBuffer(), _framingVersion(FramingV1), _wireFormat(WireFormatV1), _legacyPeer(false),
+	_cipherEngine(), _receiveTimeout(0)
+{
 }
 
-Service::Service(const std::string& socketPath) : _ioService(), _localEndpoint(socketPath), _socket(_ioService),
-	_recvBuffer(DefaultBufferSize), _recvdBytes(0), _messageQueue(), _cipherEngine()
+Service::~Service()
 {
+	// Queued messages are not dropped, but failure to send them cannot be reported from here
+	try
+	{
+		flush();
+	}
+	catch(const ConnectionFailureError&)
+	{
+	}
 }
 
-void Service::authenticate(const BigInt& modulus, const std::vector<BigInt>& privateKey)
+void Service::authenticate(const ModContext& ffsContext, const std::vector<BigInt>& privateKey)
 {
+	const auto& modulus = ffsContext.getModulus();
+
+	std::vector<BigInt> privateKeyMont;
+	privateKeyMont.reserve(privateKey.size());
+	for (const auto& s : privateKey)
+		privateKeyMont.push_back(ffsContext.toMontgomery(s));
+
 	// Calculate public key vector and send it to the server
-	auto signs = randomBits(privateKey.size());
-	std::size_t bitCounter = 0;
-	std::for_each(privateKey.begin(), privateKey.end(),
-			[&, this](const auto& s) {
-				auto sSqInv = s.raiseMod(2, modulus).invertMod(modulus);
-				this->send(signs[bitCounter++] ? -sSqInv : sSqInv);
-			});
+	for (const auto& v : FfsIdentity::derivePublicKey(ffsContext, privateKeyMont))
+		send(GroupElement{v, modulus});
 
 	// Calculate witness and send it to the server
 	auto secretR = BigInt::random(modulus.getNumberOfBits() - 1);
-	auto witness = secretR.raiseMod(2, modulus);
-	send(randomBits(1)[0] ? -witness : witness);
+	auto secretRMont = ffsContext.toMontgomery(secretR);
+	auto witness = ffsContext.fromMontgomery(ffsContext.sqrMod(secretRMont));
+	send(GroupElement{randomBits(1)[0] ? -witness : witness, modulus});
 
 	// Receive bit vector from server
 	auto usedKeyElements = receive(
@@ -38,25 +81,25 @@ void Service::authenticate(const BigInt& modulus, const std::vector<BigInt>& pri
 		);
 
 	// Calculate evidence
-	auto evidence = secretR;
-	for (std::size_t i = 0; i < usedKeyElements.size(); ++i)
-	{
-		if (!usedKeyElements[i])
-			continue;
+	BigInt evidence;
+	std::vector<const BigInt*> factors;
+	selectKeyElements(privateKeyMont, usedKeyElements, factors);
+	ffsContext.productMod(factors, evidence);
+	ffsContext.mulMod(evidence, secretRMont, evidence);
+	send(GroupElement{ffsContext.fromMontgomery(evidence), modulus});
 
-		evidence = (evidence * privateKey[i]) % modulus;
-	}
-	send(evidence);
+	// Server cannot decide until it has the evidence, so it must not wait for our next receive
+	flush();
 }
 
-bool Service::verifyAuthentication(const BigInt& modulus, std::size_t keyElementCount)
+bool Service::verifyAuthentication(const ModContext& ffsContext, std::size_t keyElementCount)
 {
 	// Receive public key vector from the client
 	std::vector<BigInt> ffsV;
 	for (std::size_t i = 0; i < keyElementCount; ++i)
 	{
 		receive([&](const Message* msg) {
-					ffsV.push_back(msg->read<BigInt>());
+					ffsV.push_back(msg->readElement(ffsContext.getModulus()));
 				}
 			);
 	}
@@ -64,7 +107,7 @@ bool Service::verifyAuthentication(const BigInt& modulus, std::size_t keyElement
 	// Receive witness from client
 	auto witness = receive(
 			[&](const Message* msg) {
-				return msg->read<BigInt>();
+				return msg->readElement(ffsContext.getModulus());
 			}
 		);
 
@@ -75,20 +118,512 @@ bool Service::verifyAuthentication(const BigInt& modulus, std::size_t keyElement
 	// Receive evidence
 	auto evidence = receive(
 			[&](const Message* msg) {
-				return msg->read<BigInt>();
+				return msg->readElement(ffsContext.getModulus());
+			}
+		);
+
+	std::vector<BigInt> ffsVMont;
+	ffsVMont.reserve(ffsV.size());
+	for (const auto& v : ffsV)
+		ffsVMont.push_back(ffsContext.toMontgomery(v));
+
+	return checkEvidence(ffsContext, ffsVMont, witness, usedKeyElements, evidence);
+}
+
+void Service::authenticateBatch(const ModContext& ffsContext, const std::vector<BigInt>& privateKey, std::size_t rounds)
+{
+	FfsIdentity identity({}, ffsContext, privateKey);
+
+	// Send public key vector together with witnesses for all rounds
+	std::vector<BigInt> secretRs;
+	auto witnesses = createWitnesses(ffsContext, rounds, secretRs);
+
+	auto witnessMsg = createMessage();
+	witnessMsg.writeElementSequence(identity.getPublicKey().begin(), identity.getPublicKey().end(), ffsContext.getModulus());
+	witnessMsg.writeElementSequence(witnesses.begin(), witnesses.end(), ffsContext.getModulus());
+	sendMessage(witnessMsg);
+
+	// Receive challenge matrix with one row of used key elements for every round
+	auto challenges = receive(
+			[&](const Message* msg) {
+				return msg->readSequence<boost::dynamic_bitset<std::uint64_t>>();
+			}
+		);
+
+	// Calculate evidences for all rounds and send them at once
+	std::vector<BigInt> evidences;
+	createEvidences(ffsContext, identity.getPrivateKey(), secretRs, challenges, evidences);
+
+	auto evidenceMsg = createMessage();
+	evidenceMsg.writeElementSequence(evidences.begin(), evidences.end(), ffsContext.getModulus());
+	sendMessage(evidenceMsg);
+
+	// Server cannot decide until it has the evidences, so they must not wait for our next receive
+	flush();
+}
+
+bool Service::verifyAuthenticationBatch(const ModContext& ffsContext, std::size_t keyElementCount, std::size_t rounds)
+{
+	// Receive public key vector and witnesses for all rounds from the client
+	std::vector<BigInt> ffsV, witnesses;
+	receive([&](const Message* msg) {
+				ffsV = msg->readElementSequence(ffsContext.getModulus());
+				witnesses = msg->readElementSequence(ffsContext.getModulus());
+			}
+		);
+
+	if (ffsV.size() != keyElementCount || witnesses.size() != rounds)
+		return false;
+
+	// Generate challenge matrix with one row of used key elements for every round
+	auto challenges = createChallenges(keyElementCount, rounds);
+
+	auto challengeMsg = createMessage();
+	challengeMsg.writeSequence<boost::dynamic_bitset<std::uint64_t>>(challenges.begin(), challenges.end());
+	sendMessage(challengeMsg);
+
+	// Receive evidences for all rounds
+	auto evidences = receive(
+			[&](const Message* msg) {
+				return msg->readElementSequence(ffsContext.getModulus());
 			}
 		);
 
-	auto finalValue = evidence.raiseMod(2, modulus);
-	for (std::size_t i = 0; i < usedKeyElements.size(); ++i)
+	std::vector<BigInt> ffsVMont;
+	ffsVMont.reserve(ffsV.size());
+	for (const auto& v : ffsV)
+		ffsVMont.push_back(ffsContext.toMontgomery(v));
+
+	return checkEvidences(ffsContext, ffsVMont, witnesses, challenges, evidences);
+}
+
+void Service::authenticateIdentity(const FfsIdentity& identity, std::size_t rounds)
+{
+	const auto& ffsContext = identity.getContext();
+
+	// Send identity together with witnesses for all rounds
+	std::vector<BigInt> secretRs;
+	auto witnesses = createWitnesses(ffsContext, rounds, secretRs);
+
+	auto witnessMsg = createMessage();
+	witnessMsg.write(identity.getId());
+	witnessMsg.writeElementSequence(witnesses.begin(), witnesses.end(), ffsContext.getModulus());
+	sendMessage(witnessMsg);
+
+	// Server asks for the public key vector only if it does not know the identity yet
+	std::vector<boost::dynamic_bitset<std::uint64_t>> challenges;
+	bool registered = false;
+	while (!registered)
 	{
-		if (!usedKeyElements[i])
-			continue;
+		receive([&](const Message* msg) {
+					registered = msg->read<std::uint8_t>() == IdentityRegistered;
+					if (registered)
+						challenges = msg->readSequence<boost::dynamic_bitset<std::uint64_t>>();
+				}
+			);
+
+		if (!registered)
+		{
+			auto publicKeyMsg = createMessage();
+			publicKeyMsg.writeElementSequence(identity.getPublicKey().begin(), identity.getPublicKey().end(), ffsContext.getModulus());
+			sendMessage(publicKeyMsg);
+		}
+	}
+
+	// Calculate evidences for all rounds and send them at once
+	std::vector<BigInt> evidences;
+	createEvidences(ffsContext, identity.getPrivateKey(), secretRs, challenges, evidences);
+
+	auto evidenceMsg = createMessage();
+	evidenceMsg.writeElementSequence(evidences.begin(), evidences.end(), ffsContext.getModulus());
+	sendMessage(evidenceMsg);
+
+	// Server cannot decide until it has the evidences, so they must not wait for our next receive
+	flush();
+}
+
+bool Service::verifyIdentity(const ModContext& ffsContext, FfsIdentityRegistry& registry, std::size_t keyElementCount, std::size_t rounds)
+{
+	// Receive identity and witnesses for all rounds from the client
+	std::string id;
+	std::vector<BigInt> witnesses;
+	receive([&](const Message* msg) {
+				id = msg->read<std::string>();
+				witnesses = msg->readElementSequence(ffsContext.getModulus());
+			}
+		);
+
+	if (witnesses.size() != rounds)
+		return false;
+
+	// Ask for public key vector of unknown identity, it is registered only once the client proves it has the private key
+	auto ffsVMont = registry.find(id);
+	bool unknown = ffsVMont == nullptr;
+	if (unknown)
+	{
+		send(static_cast<std::uint8_t>(IdentityUnknown));
+
+		auto ffsV = receive(
+				[&](const Message* msg) {
+					return msg->readElementSequence(ffsContext.getModulus());
+				}
+			);
+
+		if (ffsV.size() != keyElementCount)
+			return false;
+
+		for (auto& v : ffsV)
+			v = ffsContext.toMontgomery(v);
+
+		ffsVMont = std::make_shared<const std::vector<BigInt>>(std::move(ffsV));
+	}
+
+	if (ffsVMont->size() != keyElementCount)
+		return false;
+
+	// Generate challenge matrix with one row of used key elements for every round
+	auto challenges = createChallenges(keyElementCount, rounds);
+
+	auto challengeMsg = createMessage();
+	challengeMsg.write(static_cast<std::uint8_t>(IdentityRegistered));
+	challengeMsg.writeSequence<boost::dynamic_bitset<std::uint64_t>>(challenges.begin(), challenges.end());
+	sendMessage(challengeMsg);
+
+	// Receive evidences for all rounds
+	auto evidences = receive(
+			[&](const Message* msg) {
+				return msg->readElementSequence(ffsContext.getModulus());
+			}
+		);
 
-		finalValue = (finalValue * ffsV[i]) % modulus;
+	if (!checkEvidences(ffsContext, *ffsVMont, witnesses, challenges, evidences))
+		return false;
+
+	if (unknown)
+		registry.add(id, ffsVMont);
+
+	return true;
+}
+
+std::vector<BigInt> Service::createWitnesses(const ModContext& ffsContext, std::size_t rounds, std::vector<BigInt>& secretRs)
+{
+	const auto& modulus = ffsContext.getModulus();
+
+	auto witnessSigns = randomBits(rounds);
+	std::vector<BigInt> witnesses;
+	witnesses.reserve(rounds);
+	secretRs.clear();
+	secretRs.reserve(rounds);
+	for (std::size_t round = 0; round < rounds; ++round)
+	{
+		secretRs.push_back(ffsContext.toMontgomery(BigInt::random(modulus.getNumberOfBits() - 1)));
+		auto witness = ffsContext.fromMontgomery(ffsContext.sqrMod(secretRs.back()));
+		witnesses.push_back(witnessSigns[round] ? -std::move(witness) : std::move(witness));
+	}
+
+	return witnesses;
+}
+
+void Service::createEvidences(const ModContext& ffsContext, const std::vector<BigInt>& privateKeyMont, const std::vector<BigInt>& secretRs,
+		const std::vector<boost::dynamic_bitset<std::uint64_t>>& challenges, std::vector<BigInt>& evidences)
+{
+	auto& scratch = evidenceScratch;
+	evidences.resize(std::min(secretRs.size(), challenges.size()));
+	for (std::size_t round = 0; round < evidences.size(); ++round)
+	{
+		selectKeyElements(privateKeyMont, challenges[round], scratch.factors);
+		ffsContext.productMod(scratch.factors, scratch.product);
+		ffsContext.mulMod(scratch.product, secretRs[round], scratch.product);
+		ffsContext.fromMontgomery(scratch.product, evidences[round]);
+	}
+}
+
+std::vector<boost::dynamic_bitset<std::uint64_t>> Service::createChallenges(std::size_t keyElementCount, std::size_t rounds)
+{
+	std::vector<boost::dynamic_bitset<std::uint64_t>> challenges;
+	challenges.reserve(rounds);
+	for (std::size_t round = 0; round < rounds; ++round)
+		challenges.push_back(randomBits(keyElementCount));
+
+	return challenges;
+}
+
+void Service::selectKeyElements(const std::vector<BigInt>& keyElements, const boost::dynamic_bitset<std::uint64_t>& usedKeyElements,
+		std::vector<const BigInt*>& result)
+{
+	result.clear();
+	result.reserve(usedKeyElements.count());
+	for (auto i = usedKeyElements.find_first(); i < std::min(usedKeyElements.size(), keyElements.size()); i = usedKeyElements.find_next(i))
+		result.push_back(&keyElements[i]);
+}
+
+bool Service::checkEvidences(const ModContext& ffsContext, const std::vector<BigInt>& ffsVMont, const std::vector<BigInt>& witnesses,
+		const std::vector<boost::dynamic_bitset<std::uint64_t>>& challenges, const std::vector<BigInt>& evidences)
+{
+	if (witnesses.size() != challenges.size() || evidences.size() != challenges.size())
+		return false;
+
+	for (std::size_t round = 0; round < challenges.size(); ++round)
+	{
+		if (!checkEvidence(ffsContext, ffsVMont, witnesses[round], challenges[round], evidences[round]))
+			return false;
 	}
 
-	return witness != 0 && (finalValue == witness || finalValue == -witness);
+	return true;
+}
+
+bool Service::checkEvidence(const ModContext& ffsContext, const std::vector<BigInt>& ffsVMont, const BigInt& witness,
+		const boost::dynamic_bitset<std::uint64_t>& usedKeyElements, const BigInt& evidence)
+{
+	// Evidence which is 0 mod N makes the result 0 whatever the key elements are
+	const auto& modulus = ffsContext.getModulus();
+	if (usedKeyElements.size() != ffsVMont.size() || evidence.getSign() <= 0 || evidence >= modulus)
+		return false;
+
+	auto& scratch = evidenceScratch;
+	selectKeyElements(ffsVMont, usedKeyElements, scratch.factors);
+	ffsContext.productMod(scratch.factors, scratch.product);
+	ffsContext.toMontgomery(evidence, scratch.evidence);
+	ffsContext.sqrMod(scratch.evidence, scratch.evidence);
+	ffsContext.mulMod(scratch.product, scratch.evidence, scratch.product);
+	ffsContext.fromMontgomery(scratch.product, scratch.product);
+
+	// Witness is reduced first, otherwise its multiples (N, -N) would pass as non-zero and match the result 0
+	scratch.witness = witness;
+	scratch.witness %= modulus;
+	if (scratch.witness.getSign() < 0)
+		scratch.witness += modulus;
+
+	if (scratch.witness.getSign() == 0)
+		return false;
+
+	// Witness may have been sent negated, so the result has to match either of +-witness mod N
+	if (scratch.product == scratch.witness)
+		return true;
+
+	// Result is -witness mod N if it adds up to N with it
+	scratch.product += scratch.witness;
+	return scratch.product == modulus;
+}
+
+void Service::flush()
+{
+	if (_sendBuffer.empty())
+		return;
+
+	// All queued frames are already contiguous, so they are sent with a single write
+	boost::system::error_code errorCode;
+	boost::asio::write(_socket, boost::asio::buffer(_sendBuffer), errorCode);
+
+	// Capacity is kept, so the buffer is not reallocated for the next batch
+	std::fill(_sendBuffer.begin(), _sendBuffer.end(), 0);
+	_sendBuffer.clear();
+
+	if (errorCode)
+		throw ConnectionFailureError();
+}
+
+BigInt Service::exchangePublicKeys(const BigInt& publicKey, const BigInt& modulus)
+{
+	// Public key goes first in the original encoding, so peers without negotiation read it as they always did and ignore
+	// the rest. It is followed by the protocol identifier and the newest framing and wire format we support.
+	Message offer;
+	offer << GroupElement{publicKey, modulus};
+	offer.writeBytes(ProtocolMagic.data(), ProtocolMagic.size());
+	offer.write(static_cast<std::uint8_t>(MaxFramingVersion));
+	offer.write(static_cast<std::uint8_t>(MaxWireFormat));
+	sendMessage(offer);
+
+	std::uint8_t otherSideFraming = 0, otherSideFormat = 0;
+	auto otherSidePublicKey = receive(
+			[&](const Message* msg) {
+				try
+				{
+					auto result = msg->readElement(modulus);
+
+					// Peers without negotiation send nothing after their public key, they keep speaking the original protocol
+					_legacyPeer = msg->getRemainingSize() == 0;
+					if (_legacyPeer)
+						return result;
+
+					auto magic = msg->readBytes(ProtocolMagic.size());
+					if (!std::equal(ProtocolMagic.begin(), ProtocolMagic.end(), magic.getData()))
+						throw IncompatibleProtocolError();
+
+					otherSideFraming = msg->read<std::uint8_t>();
+					otherSideFormat = msg->read<std::uint8_t>();
+					return result;
+				}
+				catch(const NotEnoughDataError&)
+				{
+					throw IncompatibleProtocolError();
+				}
+			}
+		);
+
+	if (_legacyPeer)
+		return otherSidePublicKey;
+
+	if (otherSideFraming < FramingV1 || otherSideFormat < WireFormatV1)
+		throw IncompatibleProtocolError();
+
+	// Older versions of the two sides are used from the very next message on
+	_framingVersion = static_cast<FramingVersion>(std::min<std::uint8_t>(MaxFramingVersion, otherSideFraming));
+	_wireFormat = static_cast<WireFormat>(std::min<std::uint8_t>(MaxWireFormat, otherSideFormat));
+	return otherSidePublicKey;
+}
+
+std::size_t Service::getLegacySealedSize(std::size_t sealedSize)
+{
+	auto ciphertextSize = sealedSize - LegacyIVSize;
+	if (ciphertextSize > LegacyMaxSequenceSize)
+		throw FrameTooLongError();
+
+	return Message::getSequenceHeaderSize(LegacyIVSize) + sealedSize + Message::getSequenceHeaderSize(ciphertextSize);
+}
+
+void Service::sealLegacy(const Span<std::uint8_t>& plaintext, std::uint8_t* payload)
+{
+	// Payload is IV and ciphertext, both as byte sequences. They are sealed together behind both sequence headers
+	// and the IV is then moved in front of the ciphertext header.
+	auto ivHeaderSize = Message::getSequenceHeaderSize(LegacyIVSize);
+	auto ciphertextSize = _cipherEngine->getSealedSize(plaintext.getSize()) - LegacyIVSize;
+	auto ciphertextHeaderSize = Message::getSequenceHeaderSize(ciphertextSize);
+
+	auto sealed = payload + ivHeaderSize + ciphertextHeaderSize;
+	_cipherEngine->seal(plaintext, sealed);
+	std::memmove(payload + ivHeaderSize, sealed, LegacyIVSize);
+
+	Message::writeSequenceHeader(payload, LegacyIVSize);
+	Message::writeSequenceHeader(payload + ivHeaderSize + LegacyIVSize, ciphertextSize);
+}
+
+Span<std::uint8_t> Service::openLegacy(std::uint8_t* payload, std::size_t payloadSize)
+{
+	// Payload has to hold exactly IV and ciphertext, both as byte sequences
+	auto sealed = Message::view({payload, payloadSize});
+	std::size_t ivPos = 0, ciphertextPos = 0, ciphertextSize = 0;
+	try
+	{
+		auto iv = sealed.readByteSequence();
+		auto ciphertext = sealed.readByteSequence();
+		if (iv.getSize() != LegacyIVSize || sealed.getRemainingSize() != 0)
+			throw DecryptionError();
+
+		ivPos = iv.getData() - payload;
+		ciphertextPos = ciphertext.getData() - payload;
+		ciphertextSize = ciphertext.getSize();
+	}
+	catch(const NotEnoughDataError&)
+	{
+		throw DecryptionError();
+	}
+	catch(const SequenceTooLongError&)
+	{
+		throw DecryptionError();
+	}
+
+	// IV is moved right in front of the ciphertext, so both are opened in place as the current sealed layout
+	auto ivData = payload + ciphertextPos - LegacyIVSize;
+	std::memmove(ivData, payload + ivPos, LegacyIVSize);
+	return _cipherEngine->open(ivData, LegacyIVSize + ciphertextSize);
+}
+
+void Service::receiveMessages()
+{
+	// Only one frame is parsed at a time and the rest stays in the buffer, so the change
+	// of cipher or framing version always applies to the very next frame
+	boost::system::error_code errorCode;
+	while (!receiveBufferedMessage())
+	{
+		if (errorCode == boost::asio::error::eof)
+		{
+			if (_recvBuffer.getSize() == 0)
+				throw ConnectionClosedError();
+			else
+				throw ConnectionFailureError();
+		}
+
+		// Make room for the whole frame if we already know how large it is, so large frames are assembled without repeated reallocation
+		std::size_t payloadSize = 0;
+		std::size_t missingBytes = DefaultBufferSize;
+		if (Message::peekPayloadSize(_recvBuffer.getData(), payloadSize, _framingVersion))
+			missingBytes = std::max(missingBytes, Message::getHeaderSize(_framingVersion) + payloadSize - _recvBuffer.getSize());
+
+		if (_receiveTimeout.count() > 0)
+			waitForData();
+
+		_recvBuffer.prepare(missingBytes);
+		_recvBuffer.commit(_socket.read_some(
+				boost::asio::buffer(_recvBuffer.getFreeData(), _recvBuffer.getFreeSize()),
+				errorCode
+			));
+
+		if (errorCode && errorCode != boost::asio::error::eof)
+			throw ConnectionFailureError();
+	}
+}
+
+void Service::waitForData()
+{
+	pollfd socketPoll = { _socket.native_handle(), POLLIN, 0 };
+	while (true)
+	{
+		auto ready = poll(&socketPoll, 1, static_cast<int>(_receiveTimeout.count()));
+		if (ready > 0)
+			return; // closed or failed socket is reported by the read itself
+		else if (ready == 0)
+			throw ConnectionTimeoutError();
+		else if (errno != EINTR)
+			throw ConnectionFailureError();
+	}
+}
+
+bool Service::receiveBufferedMessage()
+{
+	auto headerSize = Message::getHeaderSize(_framingVersion);
+
+	std::size_t payloadSize = 0;
+	if (!Message::peekPayloadSize(_recvBuffer.getData(), payloadSize, _framingVersion) || headerSize + payloadSize > _recvBuffer.getSize())
+		return false;
+
+	// Sealed payload is opened in place, so only the plaintext is copied out of the buffer
+	auto payload = _recvBuffer.getWritableData() + headerSize;
+	auto message = acquireMessage();
+	if (_cipherEngine != nullptr && _legacyPeer)
+		message->assign(openLegacy(payload, payloadSize));
+	else if (_cipherEngine != nullptr)
+		message->assign(_cipherEngine->open(payload, payloadSize));
+	else
+		message->assign({payload, payloadSize});
+
+	_recvBuffer.consume(headerSize + payloadSize);
+	_messageQueue.push_back(std::move(message));
+	return true;
+}
+
+std::unique_ptr<Message> Service::acquireMessage()
+{
+	if (_freeMessages.empty())
+	{
+		auto message = std::make_unique<Message>();
+		message->setWireFormat(_wireFormat);
+		return message;
+	}
+
+	auto message = std::move(_freeMessages.back());
+	_freeMessages.pop_back();
+	message->setWireFormat(_wireFormat);
+	return message;
+}
+
+void Service::recycleMessage(std::unique_ptr<Message>&& message)
+{
+	if (message == nullptr || _freeMessages.size() >= MaxFreeMessages)
+		return;
+
+	message->clear();
+	_freeMessages.push_back(std::move(message));
 }
 
 void Service::removeCipher()
@@ -104,7 +639,7 @@ void Server::start()
 {
 	unlink(_localEndpoint.path().c_str());
 
-	boost::asio::local::stream_protocol::acceptor acceptor(_ioService, _localEndpoint);
+	boost::asio::local::stream_protocol::acceptor acceptor(*_ioService, _localEndpoint);
 	acceptor.accept(_socket);
 }
 
@@ -120,3 +655,85 @@ void Client::start()
 	if (errorCode)
 		throw UnableToConnectError();
 }
+
+Session::Session(const std::shared_ptr<boost::asio::io_service>& ioService, boost::asio::local::stream_protocol::acceptor& acceptor)
+	: Service(ioService, acceptor.local_endpoint()), _acceptor(acceptor)
+{
+}
+
+void Session::start()
+{
+	boost::system::error_code errorCode;
+	_acceptor.accept(_socket, errorCode);
+
+	if (errorCode)
+		throw ConnectionFailureError();
+}
+
+SessionServer::SessionServer(const std::string& socketPath, std::size_t threadCount)
+	: _ioService(std::make_shared<boost::asio::io_service>()), _localEndpoint(socketPath), _work(), _workers(),
+	_threadCount(std::max<std::size_t>(threadCount, 1)), _activeSessions(0)
+{
+}
+
+SessionServer::~SessionServer()
+{
+	// Let the workers finish sessions that are already running and then shut the pool down
+	_work.reset();
+	for (auto& worker : _workers)
+		worker.join();
+}
+
+void SessionServer::run(const SessionHandler& handler, const LogHandler& log)
+{
+	unlink(_localEndpoint.path().c_str());
+
+	boost::asio::local::stream_protocol::acceptor acceptor(*_ioService, _localEndpoint);
+
+	// Every session is driven by blocking calls, so each worker thread serves one session at a time
+	_work = std::make_unique<boost::asio::io_service::work>(*_ioService);
+	for (std::size_t i = 0; i < _threadCount; ++i)
+		_workers.emplace_back([this]() { _ioService->run(); });
+
+	while (true)
+	{
+		auto session = std::make_shared<Session>(_ioService, acceptor);
+		try
+		{
+			session->start();
+		}
+		catch(const ConnectionFailureError&)
+		{
+			log("Unable to accept client, still accepting others.");
+			std::this_thread::sleep_for(AcceptRetryDelay);
+			continue;
+		}
+
+		// Client which would have to wait for a worker is disconnected, so it can try again later
+		if (_activeSessions >= _threadCount)
+		{
+			log("Refusing client, all " + std::to_string(_threadCount) + " workers are busy.");
+			continue;
+		}
+
+		++_activeSessions;
+		_ioService->post(
+				[this, session, handler, log]() {
+					try
+					{
+						handler(*session);
+					}
+					catch(const std::exception& error)
+					{
+						log(std::string("Session failed: ") + error.what());
+					}
+					catch(...)
+					{
+						log("Session failed.");
+					}
+
+					--_activeSessions;
+				}
+			);
+	}
+}
@@ -1,17 +1,27 @@
 #pragma once
 
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <deque>
+#include <functional>
 #include <memory>
 #include <string>
 #include <iostream>
+#include <thread>
 
 #include <boost/asio.hpp>
 
 #include "cipher_engine.h"
+#include "dh_group.h"
+#include "dh_key_pool.h"
 #include "error.h"
+#include "ffs_identity.h"
 #include "hash.h"
 #include "message.h"
+#include "mod_context.h"
+#include "output_stream.h"
+#include "receive_buffer.h"
 #include "span.h"
 
 class ConnectionClosedError : public Error
@@ -26,6 +36,18 @@ public:
 	ConnectionFailureError() noexcept : Error("Connection failure.") {}
 };
 
+class ConnectionTimeoutError : public Error
+{
+public:
+	ConnectionTimeoutError() noexcept : Error("Other side did not send anything in time.") {}
+};
+
+class IncompatibleProtocolError : public Error
+{
+public:
+	IncompatibleProtocolError() noexcept : Error("Other side does not speak compatible protocol.") {}
+};
+
 class UnableToConnectError : public Error
 {
 public:
@@ -35,133 +57,274 @@ public:
 class Service
 {
 public:
+	constexpr static const std::size_t MaxQueuedBytes = 64 * 1024;
+	constexpr static const FramingVersion MaxFramingVersion = FramingV2;
+	constexpr static const WireFormat MaxWireFormat = WireFormatV2;
+	// Peers without negotiation only know the original cipher and hash, see isLegacyPeer()
+	constexpr static const Cipher LegacyCipher = Cipher::Aes256Cbc;
+	constexpr static const HashAlgo LegacyHash = HashAlgo::Sha256;
+
 	Service(const std::string& socketPath);
+	Service(const std::shared_ptr<boost::asio::io_service>& ioService, const boost::asio::local::stream_protocol::endpoint& endpoint);
+	virtual ~Service();
 
 	virtual void start() = 0;
 
+	FramingVersion getFramingVersion() const { return _framingVersion; }
+
+	/**
+	 * Other side does not negotiate the protocol, it speaks the original one. Key exchange then sets up LegacyCipher
+	 * with its original sealed layout (IV and ciphertext as two byte sequences) and messages are sent with framing
+	 * and wire format version 1. The rest of the original protocol (one authentication round per exchange, hashes
+	 * of version 1 frames with LegacyHash) is up to the caller.
+	 */
+	bool isLegacyPeer() const { return _legacyPeer; }
+
+	// Receiving throws ConnectionTimeoutError once the other side sends nothing for this long, zero waits forever
+	void setReceiveTimeout(std::chrono::milliseconds timeout) { _receiveTimeout = timeout; }
+	WireFormat getWireFormat() const { return _wireFormat; }
+
+	// Messages to be sent have to be encoded with the negotiated wire format
+	Message createMessage() const
+	{
+		Message msg;
+		msg.setWireFormat(_wireFormat);
+		return msg;
+	}
+
 	template <Cipher C, HashAlgo Hash>
-	void createSecuredChannel(const BigInt& generator, const BigInt& modulus)
+	void createSecuredChannel(const DhGroup& group)
 	{
 		// Calculate secret exponent E and public key G^E mod P
-		auto secretExp = BigInt::random(modulus.getNumberOfBits() - 1);
-		auto publicKey = generator.raiseMod(secretExp, modulus);
+		auto secretExp = BigInt::random(group.getExponentBits());
+		auto publicKey = group.raiseGenerator(secretExp);
 
-		// Send public key and receive public key from the other side
-		send(publicKey);
-		auto otherSidePublicKey = receive(
-				[&](const Message* msg) {
-					return msg->read<BigInt>();
-				}
-			);
+		exchangeKeys<C, Hash>(group, secretExp, publicKey);
+	}
 
-		// Calculate shared secret and derive key from it using hash function
-		auto sharedSecret = otherSidePublicKey.raiseMod(secretExp, modulus);
-		auto key = hash<Hash>(sharedSecret.getRawBytes());
+	template <Cipher C, HashAlgo Hash>
+	void createSecuredChannel(DhKeyPool& keyPool)
+	{
+		// Take pre-generated secret exponent E and public key G^E mod P
+		auto keyPair = keyPool.acquire();
 
-		// From now on, all communication is encrypted
-		setCipher<C>(key);
+		exchangeKeys<C, Hash>(keyPool.getGroup(), keyPair.secretExp, keyPair.publicKey);
 	}
 
-	void authenticate(const BigInt& modulus, const std::vector<BigInt>& privateKey);
-	bool verifyAuthentication(const BigInt& modulus, std::size_t keyElementCount);
+	void authenticate(const ModContext& ffsContext, const std::vector<BigInt>& privateKey);
+	bool verifyAuthentication(const ModContext& ffsContext, std::size_t keyElementCount);
+	void authenticateBatch(const ModContext& ffsContext, const std::vector<BigInt>& privateKey, std::size_t rounds);
+	bool verifyAuthenticationBatch(const ModContext& ffsContext, std::size_t keyElementCount, std::size_t rounds);
+	void authenticateIdentity(const FfsIdentity& identity, std::size_t rounds);
+	bool verifyIdentity(const ModContext& ffsContext, FfsIdentityRegistry& registry, std::size_t keyElementCount, std::size_t rounds);
 
 	template <typename Fn>
 	decltype(auto) receive(Fn&& fn)
 	{
-		boost::system::error_code errorCode;
-		bool retryReceive = _messageQueue.empty();
-		while (retryReceive)
+		if (_messageQueue.empty())
 		{
-			_recvdBytes += _socket.read_some(
-					boost::asio::buffer(
-						_recvBuffer.data() + _recvdBytes,
-						_recvBuffer.size() - _recvdBytes
-					),
-					errorCode
-				);
-
-			if (errorCode)
-			{
-				if (errorCode != boost::asio::error::eof)
-					throw ConnectionFailureError();
-				else if (_recvdBytes == 0)
-					throw ConnectionClosedError();
-			}
-
-			std::unique_ptr<Message> message;
-			while ((message = Message::parse(makeSpan(_recvBuffer.data(), _recvdBytes))) != nullptr)
-			{
-				std::size_t newRecvdBytes = _recvdBytes - message->getTotalSize(); // calculate size of rest of the data in the recv. buffer
-				std::memmove(_recvBuffer.data(), _recvBuffer.data() + message->getTotalSize(), newRecvdBytes); // shift recv. buffer to the left by the size of recently parsed message
-				std::memset(_recvBuffer.data() + newRecvdBytes, 0, _recvdBytes - newRecvdBytes); // nullify the trailer part of the shifted content (this is just for security reasons)
-				_recvdBytes = newRecvdBytes; // updated the size of the recv. buffer
-
-				if (_cipherEngine != nullptr)
-				{
-					auto encryptedMsg = message->read<EncryptedData>();
-					auto decryptedMsg = _cipherEngine->decrypt(encryptedMsg);
-					message = std::make_unique<Message>(decryptedMsg);
-				}
-
-				_messageQueue.push_back(std::move(message));
-			}
-
-			retryReceive = _messageQueue.empty();
+			flush(); // the other side may be waiting for what we have queued
+			receiveMessages();
 		}
 
 		auto message = std::move(_messageQueue.front());
 		_messageQueue.pop_front();
 
+		// Message goes back to the pool once fn is done with it
+		struct Recycler
+		{
+			~Recycler() { service->recycleMessage(std::move(message)); }
+
+			Service* service;
+			std::unique_ptr<Message>& message;
+		} recycler{this, message};
+
 		return fn(static_cast<const Message*>(message.get()));
 	}
 
-	Message sendMessage(const Message& message)
+	/**
+	 * Receives at least one message together with all the others which have already arrived and passes
+	 * all of them to fn at once. All of them are decrypted with the current cipher, so it must not be used
+	 * while the other side may switch to a different one.
+	 */
+	template <typename Fn>
+	decltype(auto) receiveBurst(Fn&& fn)
 	{
-		auto transmittedMsg = message;
-		if (_cipherEngine != nullptr)
+		if (_messageQueue.empty())
 		{
-			transmittedMsg = {};
-			transmittedMsg.write<EncryptedData>(_cipherEngine->encrypt(message));
+			flush(); // the other side may be waiting for what we have queued
+			receiveMessages();
 		}
 
-		boost::system::error_code errorCode;
-		auto msgBuffer = transmittedMsg.serialize();
-		std::size_t sentBytes = 0;
+		while (receiveBufferedMessage()) {}
 
-		while (sentBytes < msgBuffer.size())
+		std::vector<const Message*> messages;
+		messages.reserve(_messageQueue.size());
+		for (const auto& message : _messageQueue)
+			messages.push_back(message.get());
+
+		// Messages go back to the pool once fn is done with them
+		struct Recycler
 		{
-			sentBytes += _socket.write_some(
-					boost::asio::buffer(
-						msgBuffer.data() + sentBytes,
-						msgBuffer.size() - sentBytes
-					),
-					errorCode
-				);
+			~Recycler()
+			{
+				for (auto& message : service->_messageQueue)
+					service->recycleMessage(std::move(message));
+				service->_messageQueue.clear();
+			}
 
-			if (errorCode)
-				throw ConnectionFailureError();
-		}
+			Service* service;
+		} recycler{this};
 
-		return message;
+		return fn(static_cast<const std::vector<const Message*>&>(messages));
 	}
 
+	void sendMessage(const Message& message)
+	{
+		auto content = message.getContent();
+		auto payloadSize = _cipherEngine != nullptr ? _cipherEngine->getSealedSize(content.getSize()) : content.getSize();
+		if (_cipherEngine != nullptr && _legacyPeer)
+			payloadSize = getLegacySealedSize(payloadSize);
+
+		// Messages are framed (and sealed) directly at the end of the send buffer and sent together by flush()
+		auto framePos = _sendBuffer.size();
+		auto headerSize = Message::getHeaderSize(_framingVersion);
+		if (payloadSize > Message::getMaxPayloadSize(_framingVersion))
+			throw FrameTooLongError();
+
+		_sendBuffer.resize(framePos + headerSize + payloadSize);
+		Message::writeHeader(_sendBuffer.data() + framePos, payloadSize, _framingVersion);
+
+		auto payload = _sendBuffer.data() + framePos + headerSize;
+		if (_cipherEngine != nullptr && _legacyPeer)
+			sealLegacy(content, payload);
+		else if (_cipherEngine != nullptr)
+			_cipherEngine->seal(content, payload);
+		else
+			std::copy(content.getData(), content.getData() + content.getSize(), payload);
+
+		if (_sendBuffer.size() >= MaxQueuedBytes)
+			flush();
+	}
+
+	void flush();
+
 	template <typename... Ts>
 	Message send(Ts&&... args)
 	{
-		Message msg;
+		// Whole message is allocated at once, it does not grow with every written value
+		auto msg = createMessage();
+		msg.reserve(getSendSize(args...));
 		sendImpl(msg, std::forward<Ts>(args)...);
-		return sendMessage(msg);
+		sendMessage(msg);
+		return msg;
+	}
+
+	OutputStream openStream(std::size_t chunkSize = OutputStream::DefaultChunkSize)
+	{
+		return { *this, chunkSize };
+	}
+
+	/**
+	 * Receives the whole stream sent through OutputStream on the other side. Function is called
+	 * with data of every chunk as soon as it is decrypted. Returns the total size of the stream.
+	 */
+	template <typename Fn>
+	std::uint64_t receiveStream(Fn&& fn)
+	{
+		std::uint64_t chunkIndex = 0;
+		std::uint64_t totalSize = 0;
+		bool finished = false;
+		while (!finished)
+		{
+			receive(
+					[&](const Message* msg) {
+						auto type = msg->read<std::uint8_t>();
+						if (type > OutputStream::FinalChunk || msg->read<std::uint64_t>() != chunkIndex++)
+							throw StreamOrderError();
+
+						auto data = msg->readBytes(msg->getRemainingSize());
+						fn(data);
+
+						totalSize += data.getSize();
+						finished = type == OutputStream::FinalChunk;
+					}
+				);
+		}
+
+		return totalSize;
 	}
 
 	template <Cipher C>
-	void setCipher(const BigInt& key)
+	void setCipher(const BigInt& key, bool initiator = true)
 	{
-		_cipherEngine = std::make_unique<CipherEngine<C>>(key);
+		_cipherEngine = std::make_unique<CipherEngine<C>>(key, initiator);
 	}
 
 	void removeCipher();
 
 protected:
+	enum IdentityStatus : std::uint8_t
+	{
+		IdentityUnknown,
+		IdentityRegistered
+	};
+
+	// Checks of the authentication steps (make check) call them directly
+	friend bool checkAllocations(std::ostream& out);
+	friend bool checkAuthentication(std::ostream& out);
+	friend bool checkStream(std::ostream& out);
+
+	static std::vector<BigInt> createWitnesses(const ModContext& ffsContext, std::size_t rounds, std::vector<BigInt>& secretRs);
+	// Evidences are stored into the given vector, so its elements are reused if it is filled already
+	static void createEvidences(const ModContext& ffsContext, const std::vector<BigInt>& privateKeyMont, const std::vector<BigInt>& secretRs,
+			const std::vector<boost::dynamic_bitset<std::uint64_t>>& challenges, std::vector<BigInt>& evidences);
+	static std::vector<boost::dynamic_bitset<std::uint64_t>> createChallenges(std::size_t keyElementCount, std::size_t rounds);
+	static void selectKeyElements(const std::vector<BigInt>& keyElements, const boost::dynamic_bitset<std::uint64_t>& usedKeyElements,
+			std::vector<const BigInt*>& result);
+	static bool checkEvidences(const ModContext& ffsContext, const std::vector<BigInt>& ffsVMont, const std::vector<BigInt>& witnesses,
+			const std::vector<boost::dynamic_bitset<std::uint64_t>>& challenges, const std::vector<BigInt>& evidences);
+	static bool checkEvidence(const ModContext& ffsContext, const std::vector<BigInt>& ffsVMont, const BigInt& witness,
+			const boost::dynamic_bitset<std::uint64_t>& usedKeyElements, const BigInt& evidence);
+
+	template <Cipher C, HashAlgo Hash>
+	void exchangeKeys(const DhGroup& group, const BigInt& secretExp, const BigInt& publicKey)
+	{
+		// Send public key and receive public key from the other side, framing and wire format are negotiated along
+		auto otherSidePublicKey = exchangePublicKeys(publicKey, group.getModulus());
+
+		// Calculate shared secret and derive key from it using hash function
+		auto sharedSecret = otherSidePublicKey.raiseMod(secretExp, group.getModulus());
+		if (_legacyPeer)
+		{
+			setCipher<LegacyCipher>(hash<LegacyHash>(sharedSecret.getRawBytes()));
+			return;
+		}
+
+		auto key = hash<Hash>(sharedSecret.getRawBytes());
+
+		// From now on, all communication is encrypted, side with lower public key is the initiator
+		setCipher<C>(key, publicKey < otherSidePublicKey);
+	}
+
+	BigInt exchangePublicKeys(const BigInt& publicKey, const BigInt& modulus);
+	static std::size_t getLegacySealedSize(std::size_t sealedSize);
+	void sealLegacy(const Span<std::uint8_t>& plaintext, std::uint8_t* payload);
+	Span<std::uint8_t> openLegacy(std::uint8_t* payload, std::size_t payloadSize);
+	void receiveMessages();
+	void waitForData();
+	bool receiveBufferedMessage();
+	std::unique_ptr<Message> acquireMessage();
+	void recycleMessage(std::unique_ptr<Message>&& message);
+
+	static std::size_t getSendSize() { return 0; }
+
+	template <typename T, typename... Ts>
+	static std::size_t getSendSize(const T& arg, const Ts&... args)
+	{
+		return Message::getSerializedSize(arg) + getSendSize(args...);
+	}
+
 	void sendImpl(Message&) {}
 
 	template <typename T, typename... Ts>
@@ -171,13 +334,18 @@ protected:
 		sendImpl(msg, std::forward<Ts>(args)...);
 	}
 
-	boost::asio::io_service _ioService;
+	std::shared_ptr<boost::asio::io_service> _ioService;
 	boost::asio::local::stream_protocol::endpoint _localEndpoint;
 	boost::asio::local::stream_protocol::socket _socket;
-	std::vector<std::uint8_t> _recvBuffer;
-	std::size_t _recvdBytes;
+	ReceiveBuffer _recvBuffer;
 	std::deque<std::unique_ptr<Message>> _messageQueue;
+	std::vector<std::unique_ptr<Message>> _freeMessages;
+	std::vector<std::uint8_t> _sendBuffer;
+	FramingVersion _framingVersion;
+	WireFormat _wireFormat;
+	bool _legacyPeer;
 	std::unique_ptr<CipherEngineBase> _cipherEngine;
+	std::chrono::milliseconds _receiveTimeout;
 };
 
 class Server : public Service
@@ -195,3 +363,39 @@ public:
 
 	virtual void start() override;
 };
+
+class Session : public Service
+{
+public:
+	Session(const std::shared_ptr<boost::asio::io_service>& ioService, boost::asio::local::stream_protocol::acceptor& acceptor);
+
+	virtual void start() override;
+
+private:
+	boost::asio::local::stream_protocol::acceptor& _acceptor;
+};
+
+/**
+ * Keeps accepting clients and serves every one of them on its own worker thread. Clients above the number
+ * of workers are refused right away instead of waiting for a free worker without any feedback. Failures which
+ * do not end the server (failed accept, refused client, error of a session) are reported to the log handler.
+ */
+class SessionServer
+{
+public:
+	using SessionHandler = std::function<void(Session&)>;
+	using LogHandler = std::function<void(const std::string&)>;
+
+	SessionServer(const std::string& socketPath, std::size_t threadCount);
+	~SessionServer();
+
+	void run(const SessionHandler& handler, const LogHandler& log);
+
+private:
+	std::shared_ptr<boost::asio::io_service> _ioService;
+	boost::asio::local::stream_protocol::endpoint _localEndpoint;
+	std::unique_ptr<boost::asio::io_service::work> _work;
+	std::vector<std::thread> _workers;
+	std::size_t _threadCount;
+	std::atomic<std::size_t> _activeSessions; // including those waiting for a worker
+};
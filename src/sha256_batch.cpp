@@ -0,0 +1,295 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <memory>
+#include <numeric>
+
+#include <openssl/evp.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "sha256_batch.h"
+
+namespace {
+
+const std::size_t DigestSize = 32;
+
+void hashOneByOne(const std::vector<HashPieces>& inputs, const std::size_t* indices, std::size_t count, std::uint8_t* digests)
+{
+	// Single context is reused for all of them
+	std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> context(EVP_MD_CTX_new(), &EVP_MD_CTX_free);
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		EVP_DigestInit_ex(context.get(), EVP_sha256(), nullptr);
+		for (const auto& piece : inputs[indices[i]])
+			EVP_DigestUpdate(context.get(), piece.getData(), piece.getSize());
+		EVP_DigestFinal_ex(context.get(), digests + indices[i] * DigestSize, nullptr);
+	}
+}
+
+// Lanes need AVX2, so they are only built for x86 and everything else hashes the inputs one by one
+#if defined(__x86_64__) || defined(__i386__)
+const std::size_t BlockSize = 64;
+const std::size_t LaneCount = 8;
+// Fewer inputs than this are hashed faster one by one than with mostly empty lanes
+const std::size_t MinLaneCount = 4;
+// Longer inputs are hashed faster one by one by OpenSSL, which uses SHA extensions of the CPU if there are any
+const std::size_t MaxLaneBlockCount = 16;
+
+const std::uint32_t RoundConstants[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+const std::uint32_t InitialState[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+/**
+ * Produces padded 64-byte blocks of the message which consists of several pieces.
+ */
+class BlockReader
+{
+public:
+	BlockReader() : _pieces(nullptr), _pieceIndex(0), _piecePos(0), _totalSize(0), _blockIndex(0), _blockCount(0), _terminated(false) {}
+
+	void reset(const HashPieces& pieces)
+	{
+		_pieces = &pieces;
+		_pieceIndex = 0;
+		_piecePos = 0;
+		_totalSize = std::accumulate(pieces.begin(), pieces.end(), std::uint64_t{0},
+				[](std::uint64_t size, const Span<std::uint8_t>& piece) { return size + piece.getSize(); }
+			);
+		_blockIndex = 0;
+		_blockCount = getBlockCount(pieces);
+		_terminated = false;
+	}
+
+	static std::size_t getBlockCount(const HashPieces& pieces)
+	{
+		std::size_t totalSize = 0;
+		for (const auto& piece : pieces)
+			totalSize += piece.getSize();
+
+		// Message is followed by at least one 0x80 byte and 64-bit length
+		return (totalSize + 1 + sizeof(std::uint64_t) + BlockSize - 1) / BlockSize;
+	}
+
+	std::size_t getBlockCount() const { return _blockCount; }
+
+	void read(std::uint8_t* block)
+	{
+		std::size_t pos = 0;
+		while (pos < BlockSize && _pieceIndex < _pieces->size())
+		{
+			const auto& piece = (*_pieces)[_pieceIndex];
+			auto size = std::min(BlockSize - pos, piece.getSize() - _piecePos);
+			std::memcpy(block + pos, piece.getData() + _piecePos, size);
+			pos += size;
+			_piecePos += size;
+
+			if (_piecePos == piece.getSize())
+			{
+				++_pieceIndex;
+				_piecePos = 0;
+			}
+		}
+
+		if (pos < BlockSize && !_terminated)
+		{
+			block[pos++] = 0x80;
+			_terminated = true;
+		}
+
+		std::memset(block + pos, 0, BlockSize - pos);
+
+		// Length in bits is stored big endian at the end of the last block
+		if (++_blockIndex == _blockCount)
+		{
+			auto bitSize = _totalSize * 8;
+			for (std::size_t i = 0; i < sizeof(bitSize); ++i)
+				block[BlockSize - i - 1] = (bitSize >> (8 * i)) & 0xFF;
+		}
+	}
+
+private:
+	const HashPieces* _pieces;
+	std::size_t _pieceIndex;
+	std::size_t _piecePos;
+	std::uint64_t _totalSize;
+	std::size_t _blockIndex;
+	std::size_t _blockCount;
+	bool _terminated;
+};
+
+std::uint32_t loadBigEndian(const std::uint8_t* data)
+{
+	return (static_cast<std::uint32_t>(data[0]) << 24) | (static_cast<std::uint32_t>(data[1]) << 16)
+		| (static_cast<std::uint32_t>(data[2]) << 8) | static_cast<std::uint32_t>(data[3]);
+}
+
+template <int N>
+__attribute__((target("avx2"))) inline __m256i rotateRight(__m256i x)
+{
+	return _mm256_or_si256(_mm256_srli_epi32(x, N), _mm256_slli_epi32(x, 32 - N));
+}
+
+__attribute__((target("avx2"))) inline __m256i add(__m256i a, __m256i b)
+{
+	return _mm256_add_epi32(a, b);
+}
+
+// Compresses one block of every lane, each lane has its own state in the respective 32-bit element of the registers
+__attribute__((target("avx2"))) void compressLanes(__m256i* state, const std::array<std::array<std::uint8_t, BlockSize>, LaneCount>& blocks)
+{
+	__m256i w[64];
+	for (std::size_t t = 0; t < 16; ++t)
+	{
+		w[t] = _mm256_set_epi32(
+				loadBigEndian(blocks[7].data() + 4 * t), loadBigEndian(blocks[6].data() + 4 * t),
+				loadBigEndian(blocks[5].data() + 4 * t), loadBigEndian(blocks[4].data() + 4 * t),
+				loadBigEndian(blocks[3].data() + 4 * t), loadBigEndian(blocks[2].data() + 4 * t),
+				loadBigEndian(blocks[1].data() + 4 * t), loadBigEndian(blocks[0].data() + 4 * t)
+			);
+	}
+
+	for (std::size_t t = 16; t < 64; ++t)
+	{
+		auto s0 = _mm256_xor_si256(_mm256_xor_si256(rotateRight<7>(w[t - 15]), rotateRight<18>(w[t - 15])), _mm256_srli_epi32(w[t - 15], 3));
+		auto s1 = _mm256_xor_si256(_mm256_xor_si256(rotateRight<17>(w[t - 2]), rotateRight<19>(w[t - 2])), _mm256_srli_epi32(w[t - 2], 10));
+		w[t] = add(add(w[t - 16], s0), add(w[t - 7], s1));
+	}
+
+	auto a = state[0], b = state[1], c = state[2], d = state[3];
+	auto e = state[4], f = state[5], g = state[6], h = state[7];
+	for (std::size_t t = 0; t < 64; ++t)
+	{
+		auto s1 = _mm256_xor_si256(_mm256_xor_si256(rotateRight<6>(e), rotateRight<11>(e)), rotateRight<25>(e));
+		auto ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+		auto t1 = add(add(add(h, s1), add(ch, _mm256_set1_epi32(RoundConstants[t]))), w[t]);
+		auto s0 = _mm256_xor_si256(_mm256_xor_si256(rotateRight<2>(a), rotateRight<13>(a)), rotateRight<22>(a));
+		auto maj = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+		auto t2 = add(s0, maj);
+
+		h = g;
+		g = f;
+		f = e;
+		e = add(d, t1);
+		d = c;
+		c = b;
+		b = a;
+		a = add(t1, t2);
+	}
+
+	state[0] = add(state[0], a);
+	state[1] = add(state[1], b);
+	state[2] = add(state[2], c);
+	state[3] = add(state[3], d);
+	state[4] = add(state[4], e);
+	state[5] = add(state[5], f);
+	state[6] = add(state[6], g);
+	state[7] = add(state[7], h);
+}
+
+// Hashes up to 8 inputs in parallel, unused lanes are filled with empty blocks whose result is thrown away
+__attribute__((target("avx2"))) void hashLanes(const std::vector<HashPieces>& inputs, const std::size_t* indices, std::size_t count, std::uint8_t* digests)
+{
+	std::array<BlockReader, LaneCount> readers;
+	std::array<std::array<std::uint8_t, BlockSize>, LaneCount> blocks = {};
+	std::size_t maxBlockCount = 0;
+	for (std::size_t lane = 0; lane < count; ++lane)
+	{
+		readers[lane].reset(inputs[indices[lane]]);
+		maxBlockCount = std::max(maxBlockCount, readers[lane].getBlockCount());
+	}
+
+	__m256i state[8];
+	for (std::size_t i = 0; i < 8; ++i)
+		state[i] = _mm256_set1_epi32(InitialState[i]);
+
+	for (std::size_t blockIndex = 0; blockIndex < maxBlockCount; ++blockIndex)
+	{
+		bool anyFinished = false;
+		for (std::size_t lane = 0; lane < count; ++lane)
+		{
+			if (blockIndex < readers[lane].getBlockCount())
+			{
+				readers[lane].read(blocks[lane].data());
+				anyFinished = anyFinished || blockIndex + 1 == readers[lane].getBlockCount();
+			}
+		}
+
+		compressLanes(state, blocks);
+		if (!anyFinished)
+			continue;
+
+		// Lanes which have just processed their last block hold the final digest
+		alignas(32) std::uint32_t words[8][LaneCount];
+		for (std::size_t i = 0; i < 8; ++i)
+			_mm256_store_si256(reinterpret_cast<__m256i*>(words[i]), state[i]);
+
+		for (std::size_t lane = 0; lane < count; ++lane)
+		{
+			if (blockIndex + 1 != readers[lane].getBlockCount())
+				continue;
+
+			auto digest = digests + indices[lane] * DigestSize;
+			for (std::size_t i = 0; i < 8; ++i)
+			{
+				digest[4 * i] = words[i][lane] >> 24;
+				digest[4 * i + 1] = (words[i][lane] >> 16) & 0xFF;
+				digest[4 * i + 2] = (words[i][lane] >> 8) & 0xFF;
+				digest[4 * i + 3] = words[i][lane] & 0xFF;
+			}
+		}
+	}
+}
+
+// Short inputs are hashed in lanes, the rest one by one
+void hashInLanes(const std::vector<HashPieces>& inputs, std::vector<std::size_t>& indices, std::uint8_t* digests)
+{
+	// Inputs of similar length are put next to each other, so lanes are not left idle while the longest input is finished
+	std::vector<std::size_t> blockCounts(inputs.size());
+	for (std::size_t i = 0; i < inputs.size(); ++i)
+		blockCounts[i] = BlockReader::getBlockCount(inputs[i]);
+	std::stable_sort(indices.begin(), indices.end(), [&](std::size_t lhs, std::size_t rhs) { return blockCounts[lhs] < blockCounts[rhs]; });
+
+	auto laneInputCount = static_cast<std::size_t>(std::partition_point(indices.begin(), indices.end(),
+			[&](std::size_t index) { return blockCounts[index] <= MaxLaneBlockCount; }
+		) - indices.begin());
+
+	std::size_t pos = 0;
+	for (; laneInputCount - pos >= MinLaneCount; pos += std::min(LaneCount, laneInputCount - pos))
+		hashLanes(inputs, indices.data() + pos, std::min(LaneCount, laneInputCount - pos), digests);
+
+	hashOneByOne(inputs, indices.data() + pos, indices.size() - pos, digests);
+}
+#endif
+
+}
+
+void sha256Batch(const std::vector<HashPieces>& inputs, std::uint8_t* digests)
+{
+	std::vector<std::size_t> indices(inputs.size());
+	std::iota(indices.begin(), indices.end(), 0);
+
+#if defined(__x86_64__) || defined(__i386__)
+	static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+	if (hasAvx2 && inputs.size() >= MinLaneCount)
+	{
+		hashInLanes(inputs, indices, digests);
+		return;
+	}
+#endif
+
+	hashOneByOne(inputs, indices.data(), indices.size(), digests);
+}
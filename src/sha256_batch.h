@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "span.h"
+
+// Message to hash may consist of several pieces, which are hashed as if they were one contiguous buffer
+using HashPieces = std::vector<Span<std::uint8_t>>;
+
+/**
+ * Calculates SHA-256 digests of all inputs at once. Digests are stored one after another into digests.
+ *
+ * If the CPU is x86 with AVX2, inputs are hashed 8 at a time, each of them in its own lane of the vector
+ * registers. Otherwise (or for the remainder which does not fill enough lanes) they are hashed one by one.
+ */
+void sha256Batch(const std::vector<HashPieces>& inputs, std::uint8_t* digests);
@@ -1,8 +1,18 @@
+#include "random_pool.h"
 #include "utils.h"
 
 boost::dynamic_bitset<std::uint64_t> randomBits(std::size_t numberOfBits)
 {
-	std::uint64_t bits;
-	RAND_bytes(reinterpret_cast<std::uint8_t*>(&bits), sizeof(bits));
-	return boost::dynamic_bitset<std::uint64_t>(numberOfBits, bits);
+	using Bitset = boost::dynamic_bitset<std::uint64_t>;
+
+	auto& pool = RandomPool::getThreadInstance();
+
+	Bitset bits;
+	bits.reserve(numberOfBits);
+	for (std::size_t i = 0; i < numberOfBits; i += Bitset::bits_per_block)
+		bits.append(pool.generate<Bitset::block_type>());
+
+	// Shrinking clears the unused bits of the last block
+	bits.resize(numberOfBits);
+	return bits;
 }
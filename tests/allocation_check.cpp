@@ -0,0 +1,184 @@
+#include <cstdlib>
+#include <iomanip>
+#include <new>
+
+#include <gmp.h>
+
+#include <boost/dynamic_bitset.hpp>
+
+#include "checks.h"
+#include "service.h"
+
+namespace {
+
+const std::size_t Iterations = 1000;
+const std::size_t Rounds = 16;
+// Fewer than a single thread multiplies in productMod(), so the selected elements are not split into chunks
+const std::size_t KeyElementCount = 48;
+
+// Allocations are only counted on the thread running countAllocations()
+thread_local std::size_t* allocationCount = nullptr;
+
+void* (*gmpAllocate)(std::size_t);
+void* (*gmpReallocate)(void*, std::size_t, std::size_t);
+void (*gmpFree)(void*, std::size_t);
+
+void countAllocation()
+{
+	if (allocationCount != nullptr)
+		++*allocationCount;
+}
+
+void* countingGmpAllocate(std::size_t size)
+{
+	countAllocation();
+	return gmpAllocate(size);
+}
+
+void* countingGmpReallocate(void* ptr, std::size_t oldSize, std::size_t newSize)
+{
+	countAllocation();
+	return gmpReallocate(ptr, oldSize, newSize);
+}
+
+// GMP memory functions are switched to the counting ones only for the lifetime of the guard
+struct GmpMemoryGuard
+{
+	GmpMemoryGuard()
+	{
+		mp_get_memory_functions(&gmpAllocate, &gmpReallocate, &gmpFree);
+		mp_set_memory_functions(&countingGmpAllocate, &countingGmpReallocate, gmpFree);
+	}
+
+	~GmpMemoryGuard()
+	{
+		mp_set_memory_functions(gmpAllocate, gmpReallocate, gmpFree);
+	}
+};
+
+template <typename Fn>
+std::size_t countAllocations(Fn&& fn)
+{
+	std::size_t count = 0;
+	allocationCount = &count;
+	try
+	{
+		fn();
+	}
+	catch(...)
+	{
+		allocationCount = nullptr;
+		throw;
+	}
+
+	allocationCount = nullptr;
+	return count;
+}
+
+}
+
+// Replaced global allocation functions, they only count allocations in addition to the default behavior
+void* operator new(std::size_t size)
+{
+	countAllocation();
+	while (true)
+	{
+		if (auto ptr = std::malloc(size != 0 ? size : 1))
+			return ptr;
+
+		auto handler = std::get_new_handler();
+		if (handler == nullptr)
+			throw std::bad_alloc();
+
+		handler();
+	}
+}
+
+void operator delete(void* ptr) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+	std::free(ptr);
+}
+
+bool checkAllocations(std::ostream& out)
+{
+	auto modulus = getCheckModulus();
+
+	ModContext ffsContext(modulus);
+	auto bits = modulus.getNumberOfBits() - 1;
+
+	GmpMemoryGuard gmpGuard;
+	bool ok = true;
+	auto report = [&](const std::string& name, std::size_t count) {
+		out << std::setw(50) << std::left << name << std::right << std::setw(10) << count << (count == 0 ? "" : "   UNEXPECTED") << '\n';
+		ok = ok && count == 0;
+	};
+
+	out << "=== Heap allocations in " << Iterations << " iterations after warm-up\n";
+
+	// In-place arithmetic reuses storage of the result once it is large enough
+	auto lhs = BigInt::random(bits), rhs = BigInt::random(bits), result = BigInt::random(bits);
+	BigInt::mulMod(lhs, rhs, modulus, result);
+	report("BigInt::mulMod", countAllocations([&]() {
+			for (std::size_t i = 0; i < Iterations; ++i)
+				BigInt::mulMod(result, rhs, modulus, result);
+		}));
+
+	auto lhsMont = ffsContext.toMontgomery(lhs), rhsMont = ffsContext.toMontgomery(rhs), resultMont = lhsMont;
+	ffsContext.mulMod(resultMont, rhsMont, resultMont);
+	report("ModContext::mulMod and sqrMod", countAllocations([&]() {
+			for (std::size_t i = 0; i < Iterations; ++i)
+			{
+				ffsContext.mulMod(resultMont, rhsMont, resultMont);
+				ffsContext.sqrMod(resultMont, resultMont);
+			}
+		}));
+
+	// Valid proof, so the check goes all the way to the comparison with the witness
+	std::vector<BigInt> privateKeyMont, publicKeyMont, secretRs, witnesses;
+	for (std::size_t i = 0; i < KeyElementCount; ++i)
+		privateKeyMont.push_back(ffsContext.toMontgomery(BigInt::random(bits)));
+	for (const auto& v : FfsIdentity::derivePublicKey(ffsContext, privateKeyMont))
+		publicKeyMont.push_back(ffsContext.toMontgomery(v));
+	for (std::size_t round = 0; round < Rounds; ++round)
+	{
+		secretRs.push_back(ffsContext.toMontgomery(BigInt::random(bits)));
+		witnesses.push_back(ffsContext.fromMontgomery(ffsContext.sqrMod(secretRs.back())));
+	}
+
+	boost::dynamic_bitset<std::uint64_t> singleElement(KeyElementCount), allElements(KeyElementCount);
+	singleElement.set(0);
+	allElements.set();
+
+	out << "=== Heap allocations in " << Rounds << " rounds after warm-up\n";
+	for (const auto& usedKeyElements : { singleElement, allElements })
+	{
+		auto elements = " (" + std::to_string(usedKeyElements.count()) + " of " + std::to_string(KeyElementCount) + " key elements)";
+		std::vector<boost::dynamic_bitset<std::uint64_t>> challenges(Rounds, usedKeyElements);
+
+		// Evidences of the warm-up are overwritten in place
+		std::vector<BigInt> evidences;
+		Service::createEvidences(ffsContext, privateKeyMont, secretRs, challenges, evidences);
+		report("Service::createEvidences" + elements, countAllocations([&]() {
+				Service::createEvidences(ffsContext, privateKeyMont, secretRs, challenges, evidences);
+			}));
+
+		bool valid = Service::checkEvidences(ffsContext, publicKeyMont, witnesses, challenges, evidences);
+		report("Service::checkEvidence" + elements, countAllocations([&]() {
+				for (std::size_t round = 0; round < Rounds; ++round)
+					valid = Service::checkEvidence(ffsContext, publicKeyMont, witnesses[round], challenges[round], evidences[round]) && valid;
+			}));
+
+		if (!valid)
+		{
+			out << "Valid evidences were rejected" << elements << '\n';
+			ok = false;
+		}
+	}
+
+	return ok;
+}
@@ -0,0 +1,91 @@
+#include <iomanip>
+
+#include <boost/dynamic_bitset.hpp>
+
+#include "checks.h"
+#include "service.h"
+
+namespace {
+
+const std::size_t KeyElementCount = 5;
+
+}
+
+bool checkAuthentication(std::ostream& out)
+{
+	auto modulus = getCheckModulus();
+
+	ModContext ffsContext(modulus);
+	bool ok = true;
+	auto report = [&](const std::string& name, bool accepted, bool expected) {
+		out << std::setw(50) << std::left << name << std::right << std::setw(10) << (accepted ? "accepted" : "rejected")
+			<< (accepted == expected ? "" : "   UNEXPECTED") << '\n';
+		ok = ok && accepted == expected;
+	};
+
+	std::vector<BigInt> privateKeyMont, publicKeyMont;
+	for (std::size_t i = 0; i < KeyElementCount; ++i)
+		privateKeyMont.push_back(ffsContext.toMontgomery(BigInt::random(modulus.getNumberOfBits() - 1)));
+	for (const auto& v : FfsIdentity::derivePublicKey(ffsContext, privateKeyMont))
+		publicKeyMont.push_back(ffsContext.toMontgomery(v));
+
+	boost::dynamic_bitset<std::uint64_t> allElements(KeyElementCount);
+	allElements.set();
+
+	out << "=== Evidence checks\n";
+
+	// Valid proof with the witness sent as it is and negated
+	std::vector<BigInt> secretRs;
+	auto witnesses = Service::createWitnesses(ffsContext, 1, secretRs);
+	std::vector<BigInt> evidences;
+	Service::createEvidences(ffsContext, privateKeyMont, secretRs, { allElements }, evidences);
+	report("valid witness", Service::checkEvidence(ffsContext, publicKeyMont, witnesses[0], allElements, evidences[0]), true);
+	report("valid witness negated", Service::checkEvidence(ffsContext, publicKeyMont, -witnesses[0], allElements, evidences[0]), true);
+
+	// Multiples of N must not pass as a witness of evidence which is 0 mod N, whatever the challenge is
+	boost::dynamic_bitset<std::uint64_t> noElements(KeyElementCount);
+	for (const auto& usedKeyElements : { noElements, allElements })
+	{
+		auto challenge = " (" + std::to_string(usedKeyElements.count()) + " key elements)";
+		for (const auto& witness : { std::make_pair("0", BigInt(0)), std::make_pair("N", modulus), std::make_pair("-N", -modulus) })
+		{
+			for (const auto& evidence : { std::make_pair("0", BigInt(0)), std::make_pair("N", modulus) })
+			{
+				report(std::string("witness ") + witness.first + ", evidence " + evidence.first + challenge,
+					Service::checkEvidence(ffsContext, publicKeyMont, witness.second, usedKeyElements, evidence.second), false);
+			}
+		}
+	}
+
+	out << "=== Received group elements\n";
+
+	// Values which are not reduced are refused already when they are read
+	for (auto format : { WireFormatV1, WireFormatV2 })
+	{
+		auto formatName = std::string(" (wire format ") + std::to_string(format) + ")";
+		for (const auto& value : { std::make_pair("N - 1", modulus - 1), std::make_pair("N", modulus), std::make_pair("-N", -modulus) })
+		{
+			// V2 cannot carry negative values, its fixed width is filled with the magnitude instead
+			Message msg;
+			msg.setWireFormat(format);
+			if (format == WireFormatV1)
+				msg.write(value.second);
+			else
+				value.second.writeRawBytes(msg.appendBytes(Message::getElementSize(modulus)), Message::getElementSize(modulus));
+
+			bool accepted = true;
+			try
+			{
+				msg.readElement(modulus);
+			}
+			catch(const ElementOutOfRangeError&)
+			{
+				accepted = false;
+			}
+
+			report(std::string("element ") + value.first + formatName, accepted, value.first == std::string("N - 1"));
+		}
+	}
+
+	return ok;
+}
@@ -0,0 +1,13 @@
+#include <iostream>
+
+#include "checks.h"
+
+int main()
+{
+	bool ok = true;
+	for (auto check : { &checkAllocations, &checkAuthentication, &checkStream })
+		ok = check(std::cout) && ok;
+
+	std::cout << "=== " << (ok ? "All checks passed." : "Some checks FAILED.") << std::endl;
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,137 @@
+#include <exception>
+#include <iomanip>
+#include <thread>
+
+#include "checks.h"
+#include "service.h"
+
+namespace {
+
+const std::uint64_t StreamSize = 32 * 1024 * 1024;
+const std::size_t ChunkSize = OutputStream::DefaultChunkSize;
+// Not a multiple of the chunk size, so writes keep straddling chunk boundaries
+const std::size_t WriteSize = 10007;
+// Buffers are allowed to grow to a few frames and a full send queue, never to anything proportional to the stream
+const std::size_t MaxBufferSize = 4 * (Service::MaxQueuedBytes + ChunkSize);
+
+// Every 8 bytes carry their own position, so any lost, repeated or reordered data shows up in the content
+std::uint8_t getStreamByte(std::uint64_t pos)
+{
+	return static_cast<std::uint8_t>((pos / 8) >> (8 * (pos % 8)));
+}
+
+}
+
+bool checkStream(std::ostream& out)
+{
+	bool ok = true;
+	auto report = [&](const std::string& name, const std::string& result, bool expected) {
+		out << std::setw(50) << std::left << name << std::right << std::setw(10) << result << (expected ? "" : "   UNEXPECTED") << '\n';
+		ok = ok && expected;
+	};
+
+	// Both ends of a socket pair, encrypted with the same key as after the key exchange
+	Client sender("");
+	Client receiver("");
+	boost::asio::local::connect_pair(sender._socket, receiver._socket);
+	auto key = BigInt::random(8 * CipherTraits<Cipher::Aes256Gcm>::KeySize);
+	sender.setCipher<Cipher::Aes256Gcm>(key, true);
+	receiver.setCipher<Cipher::Aes256Gcm>(key, false);
+
+	out << "=== Stream of " << StreamSize / (1024 * 1024) << " MiB in chunks of " << ChunkSize << " bytes\n";
+
+	std::exception_ptr senderError;
+	std::thread senderThread([&]() {
+			try
+			{
+				auto stream = sender.openStream(ChunkSize);
+				std::vector<std::uint8_t> data(WriteSize);
+				for (std::uint64_t pos = 0; pos < StreamSize; pos += WriteSize)
+				{
+					auto size = static_cast<std::size_t>(std::min<std::uint64_t>(WriteSize, StreamSize - pos));
+					for (std::size_t i = 0; i < size; ++i)
+						data[i] = getStreamByte(pos + i);
+
+					stream.write({data.data(), size});
+				}
+
+				stream.finish();
+			}
+			catch(...)
+			{
+				senderError = std::current_exception();
+			}
+		});
+
+	// Chunks are checked as they arrive, every one of them but the last has to be full
+	std::uint64_t receivedSize = 0, totalSize = 0;
+	std::size_t chunkCount = 0, partialChunks = 0;
+	bool contentMatches = true;
+	try
+	{
+		totalSize = receiver.receiveStream(
+				[&](const Span<std::uint8_t>& data) {
+					if (data.getSize() != ChunkSize)
+						++partialChunks;
+
+					for (std::size_t i = 0; i < data.getSize() && contentMatches; ++i)
+						contentMatches = data.getData()[i] == getStreamByte(receivedSize + i);
+
+					receivedSize += data.getSize();
+					++chunkCount;
+				}
+			);
+	}
+	catch(const Error& error)
+	{
+		out << "Receiving failed: " << error.what() << '\n';
+		ok = false;
+
+		// Sender blocked on the full socket gets an error instead of waiting forever
+		receiver._socket.close();
+	}
+
+	senderThread.join();
+	if (senderError != nullptr)
+	{
+		try
+		{
+			std::rethrow_exception(senderError);
+		}
+		catch(const Error& error)
+		{
+			out << "Sending failed: " << error.what() << '\n';
+			ok = false;
+		}
+	}
+
+	if (!ok)
+		return false;
+
+	auto expectedChunks = static_cast<std::size_t>((StreamSize + ChunkSize - 1) / ChunkSize);
+	report("received size", std::to_string(totalSize), totalSize == StreamSize && receivedSize == StreamSize);
+	report("chunks", std::to_string(chunkCount), chunkCount == expectedChunks && partialChunks <= 1);
+	report("content in order", contentMatches ? "yes" : "no", contentMatches);
+	report("sender buffer capacity", std::to_string(sender._sendBuffer.capacity()), sender._sendBuffer.capacity() <= MaxBufferSize);
+	report("receiver buffer capacity", std::to_string(receiver._recvBuffer.getCapacity()), receiver._recvBuffer.getCapacity() <= MaxBufferSize);
+
+	// Chunk which skips an index has to be refused however correctly it is encrypted
+	auto skipped = sender.createMessage();
+	skipped.write<std::uint8_t>(OutputStream::DataChunk);
+	skipped.write<std::uint64_t>(1);
+	sender.sendMessage(skipped);
+	sender.flush();
+
+	bool refused = false;
+	try
+	{
+		receiver.receiveStream([](const Span<std::uint8_t>&) {});
+	}
+	catch(const StreamOrderError&)
+	{
+		refused = true;
+	}
+
+	report("chunk with skipped index", refused ? "rejected" : "accepted", refused);
+	return ok;
+}